@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "cmdqueue.h"
+#include "util.h"
+
+// throughput and latency percentiles per workload, engine, producer count and command size
+// usage: bench [-j] [-p max_producers] [-n ops_per_run] [-s spin_max_ns] [-m magazine_size], CSV on stdout or JSON with -j
+
+typedef enum {
+    Workload_Async,     // async submit, latency is getcmd + submit
+    Workload_Sync,      // sync round trip
+    Workload_Prio,      // high prio round trip while the producers flood the low lane
+    Workload_Exhaust,   // async submit on a 4 command pool, latency is the getcmd wait
+} Workload;
+
+static const char* workload_names[] = { "async", "sync", "prio", "exhaust" };
+
+typedef struct {
+    Cmd cmd;
+    uint32_t spin;      // callback work
+    uint8_t payload[];
+} BenchCmd;
+
+typedef struct {
+    CmdQueue* queue;
+    Workload workload;
+    uint32_t size_cmd;
+    uint32_t ops;
+    uint64_t* samples;
+} Producer;
+
+typedef struct {
+    Workload workload;
+    const char* engine;
+    uint32_t producers;
+    uint32_t size_cmd;
+    uint32_t ops;
+    double ops_per_sec;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+} Result;
+
+static int32_t flood_stop;
+static int32_t json;
+static uint32_t num_results;
+static int64_t spin_max_ns = -1;    // attr default
+static uint32_t magazine_size;
+
+static void callback(void* cookie, Cmd* c) {
+    BenchCmd* cmd = to_container(BenchCmd, cmd, c);
+    volatile uint32_t x = cmd->payload[0];
+    for (uint32_t i=0; i<cmd->spin; i++) x += i;
+}
+
+static BenchCmd* bench_getcmd(Producer* p, uint32_t spin) {
+    BenchCmd* cmd = (BenchCmd*)cmdqueue_getcmd_sync(p->queue);
+    cmd->spin = spin;
+    memset(cmd->payload, 0x5a, p->size_cmd - sizeof(BenchCmd));
+    return cmd;
+}
+
+static void* producer_func(void* arg) {
+    Producer* p = (Producer*)arg;
+    for (uint32_t i=0; i<p->ops; i++) {
+        uint64_t start = now_ns();
+        switch (p->workload) {
+        case Workload_Async:
+            cmdqueue_async_cmd(p->queue, &bench_getcmd(p, 0)->cmd);
+            p->samples[i] = now_ns() - start;
+            break;
+        case Workload_Sync:
+            cmdqueue_sync_cmd(p->queue, &bench_getcmd(p, 0)->cmd);
+            p->samples[i] = now_ns() - start;
+            break;
+        case Workload_Exhaust: {
+            BenchCmd* cmd = bench_getcmd(p, 2000);
+            p->samples[i] = now_ns() - start;
+            cmdqueue_async_cmd(p->queue, &cmd->cmd);
+            break;
+        }
+        case Workload_Prio:
+            cmdqueue_sync_highprio_cmd(p->queue, &bench_getcmd(p, 0)->cmd);
+            p->samples[i] = now_ns() - start;
+            usleep(20);
+            break;
+        }
+    }
+    return 0;
+}
+
+static void* flood_func(void* arg) {
+    Producer* p = (Producer*)arg;
+    while (!__atomic_load_n(&flood_stop, __ATOMIC_RELAXED)) {
+        cmdqueue_async_cmd(p->queue, &bench_getcmd(p, 500)->cmd);
+    }
+    return 0;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t* sorted, uint32_t n, double pct) {
+    return sorted[(uint32_t)((double)(n - 1) * pct / 100.0)];
+}
+
+static void print_result(const Result* r) {
+    if (json) {
+        printf("%s  {\"workload\":\"%s\",\"engine\":\"%s\",\"producers\":%u,\"size_cmd\":%u,\"ops\":%u,"
+               "\"ops_per_sec\":%.0f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}",
+               num_results ? ",\n" : "", workload_names[r->workload], r->engine, r->producers, r->size_cmd,
+               r->ops, r->ops_per_sec, (unsigned long long)r->p50_ns, (unsigned long long)r->p99_ns,
+               (unsigned long long)r->p999_ns);
+    } else {
+        printf("%s,%s,%u,%u,%u,%.0f,%llu,%llu,%llu\n",
+               workload_names[r->workload], r->engine, r->producers, r->size_cmd, r->ops, r->ops_per_sec,
+               (unsigned long long)r->p50_ns, (unsigned long long)r->p99_ns, (unsigned long long)r->p999_ns);
+    }
+    fflush(stdout);
+    num_results++;
+}
+
+static void run(Workload workload, uint32_t flags, uint32_t num, uint32_t size_cmd, uint32_t ops) {
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags = flags;
+    if (spin_max_ns >= 0) attr.spin_max_ns = (uint64_t)spin_max_ns;
+    attr.magazine_size = magazine_size;
+    uint32_t num_commands = (workload == Workload_Exhaust) ? 4 : 1024;
+    CmdQueue* queue = cmdqueue_create_attr("bench", callback, NULL, num_commands, size_cmd, &attr);
+
+    // the prio workload measures from one extra thread, the others only load the queue
+    uint32_t measured = (workload == Workload_Prio) ? 1 : num;
+    uint32_t per_thread = (workload == Workload_Prio) ? ops / 20 : ops / num;
+    if (!per_thread) per_thread = 1;
+    Producer* list = calloc(num + 1, sizeof(Producer));
+    pthread_t* tids = calloc(num + 1, sizeof(pthread_t));
+    uint64_t* samples = malloc((size_t)measured * per_thread * sizeof(uint64_t));
+
+    for (uint32_t i=0; i<=num; i++) {
+        list[i].queue = queue;
+        list[i].workload = workload;
+        list[i].size_cmd = size_cmd;
+    }
+    __atomic_store_n(&flood_stop, 0, __ATOMIC_RELAXED);
+    if (workload == Workload_Prio) {
+        for (uint32_t i=1; i<=num; i++) pthread_create(&tids[i], 0, flood_func, &list[i]);
+        usleep(1000);
+    }
+
+    uint64_t start = now_ns();
+    for (uint32_t i=0; i<measured; i++) {
+        list[i].ops = per_thread;
+        list[i].samples = samples + (size_t)i * per_thread;
+        pthread_create(&tids[i], 0, producer_func, &list[i]);
+    }
+    for (uint32_t i=0; i<measured; i++) pthread_join(tids[i], 0);
+    uint64_t elapsed = now_ns() - start;
+
+    if (workload == Workload_Prio) {
+        __atomic_store_n(&flood_stop, 1, __ATOMIC_RELAXED);
+        for (uint32_t i=1; i<=num; i++) pthread_join(tids[i], 0);
+    } else {
+        // the low lane runs in order, so this one returns after every async command ran
+        cmdqueue_sync_cmd(queue, &bench_getcmd(&list[0], 0)->cmd);
+        elapsed = now_ns() - start;
+    }
+
+    uint32_t n = measured * per_thread;
+    qsort(samples, n, sizeof(uint64_t), compare_u64);
+    Result r;
+    r.workload = workload;
+    r.engine = (flags & CMDQUEUE_ATTR_LOCKFREE) ? "lockfree" : "locked";
+    r.producers = num;
+    r.size_cmd = size_cmd;
+    r.ops = n;
+    r.ops_per_sec = (double)n * 1e9 / (double)elapsed;
+    r.p50_ns = percentile(samples, n, 50.0);
+    r.p99_ns = percentile(samples, n, 99.0);
+    r.p999_ns = percentile(samples, n, 99.9);
+    print_result(&r);
+
+    cmdqueue_destroy(queue);
+    free(samples);
+    free(tids);
+    free(list);
+}
+
+int main(int argc, char* argv[]) {
+    static const uint32_t sizes[] = { sizeof(BenchCmd), 256, 4096 };
+    static const uint32_t engines[] = { 0, CMDQUEUE_ATTR_LOCKFREE };
+    uint32_t max_producers = 8;
+    uint32_t ops = 50000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "jp:n:s:m:")) != -1) {
+        switch (opt) {
+        case 'j':
+            json = 1;
+            break;
+        case 'p':
+            max_producers = (uint32_t)atoi(optarg);
+            break;
+        case 'n':
+            ops = (uint32_t)atoi(optarg);
+            break;
+        case 's':
+            spin_max_ns = atoll(optarg);
+            break;
+        case 'm':
+            magazine_size = (uint32_t)atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-j] [-p max_producers] [-n ops_per_run] [-s spin_max_ns] [-m magazine_size]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!max_producers || !ops) return 1;
+
+    if (json) {
+        printf("[\n");
+    } else {
+        printf("workload,engine,producers,size_cmd,ops,ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+    }
+    for (uint32_t w=0; w<ARRAY_SIZE(workload_names); w++) {
+        for (uint32_t e=0; e<ARRAY_SIZE(engines); e++) {
+            for (uint32_t s=0; s<ARRAY_SIZE(sizes); s++) {
+                for (uint32_t p=1; p<=max_producers; p *= 2) {
+                    run((Workload)w, engines[e], p, sizes[s], ops);
+                }
+            }
+        }
+    }
+    if (json) printf("\n]\n");
+    return 0;
+}
+
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "cmdqueue.h"
+#include "util.h"
+
+// cache and TLB misses per command for the pool layout modes, counted with perf_event_open over
+// every thread of the run. Built twice by make bench: bench_layout_packed drops the CmdQueue padding.
+// Generic counters have no HITM, for cross core contention run: perf c2c record bench/bench_layout
+// usage: bench_layout [-p producers] [-n ops_per_producer]
+
+typedef struct {
+    Cmd cmd;
+    uint32_t value;
+} LayoutCmd;
+
+typedef struct {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+} Counter;
+
+static const Counter counters[] = {
+    { "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "cache_refs", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+    { "l1d_misses", PERF_TYPE_HW_CACHE,
+      PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { "dtlb_misses", PERF_TYPE_HW_CACHE,
+      PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+
+static const struct {
+    const char* name;
+    uint32_t flags;
+} modes[] = {
+    { "default", 0 },
+    { "align", CMDQUEUE_ATTR_ALIGN },
+    { "align_huge", CMDQUEUE_ATTR_ALIGN | CMDQUEUE_ATTR_HUGEPAGES | CMDQUEUE_ATTR_PREFAULT },
+};
+
+#ifdef CMDQUEUE_PACKED
+#define LAYOUT "packed"
+#else
+#define LAYOUT "padded"
+#endif
+
+static CmdQueue* queue;
+static uint32_t ops;
+static uint32_t sink;
+
+static void callback(void* cookie, Cmd* c) {
+    LayoutCmd* cmd = to_container(LayoutCmd, cmd, c);
+    __atomic_add_fetch(&sink, cmd->value, __ATOMIC_RELAXED);
+}
+
+static void* producer_func(void* arg) {
+    for (uint32_t i=0; i<ops; i++) {
+        LayoutCmd* cmd = (LayoutCmd*)cmdqueue_getcmd_sync(queue);
+        cmd->value = i;
+        if ((i & 63) == 63) {
+            cmdqueue_sync_cmd(queue, &cmd->cmd);
+        } else {
+            cmdqueue_async_cmd(queue, &cmd->cmd);
+        }
+    }
+    return 0;
+}
+
+// counts this thread and every thread it creates afterwards, -1 when the kernel refuses
+static int counter_open(const Counter* counter) {
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.size = sizeof(pe);
+    pe.type = counter->type;
+    pe.config = counter->config;
+    pe.disabled = 1;
+    pe.inherit = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static void run(const char* mode, uint32_t flags, uint32_t producers) {
+    // opened first so the worker threads inherit the counters too
+    int fds[ARRAY_SIZE(counters)];
+    for (uint32_t i=0; i<ARRAY_SIZE(counters); i++) fds[i] = counter_open(&counters[i]);
+
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags = flags;
+    queue = cmdqueue_create_attr("bench", callback, NULL, 1024, sizeof(LayoutCmd), &attr);
+    for (uint32_t i=0; i<ARRAY_SIZE(counters); i++) {
+        if (fds[i] != -1) ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    pthread_t* tids = calloc(producers, sizeof(pthread_t));
+    uint64_t start = now_ns();
+    for (uint32_t i=0; i<producers; i++) pthread_create(&tids[i], 0, producer_func, NULL);
+    for (uint32_t i=0; i<producers; i++) pthread_join(tids[i], 0);
+    uint64_t elapsed = now_ns() - start;
+
+    uint64_t total = (uint64_t)producers * ops;
+    printf("%s,%s,%u,%.0f", LAYOUT, mode, producers, (double)total * 1e9 / (double)elapsed);
+    for (uint32_t i=0; i<ARRAY_SIZE(counters); i++) {
+        uint64_t value = 0;
+        if (fds[i] != -1 && read(fds[i], &value, sizeof(value)) == sizeof(value)) {
+            printf(",%.3f", (double)value / (double)total);
+        } else {
+            printf(",n/a");
+        }
+        if (fds[i] != -1) close(fds[i]);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    cmdqueue_destroy(queue);
+    free(tids);
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t max_producers = 4;
+    ops = 200000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:")) != -1) {
+        switch (opt) {
+        case 'p':
+            max_producers = (uint32_t)atoi(optarg);
+            break;
+        case 'n':
+            ops = (uint32_t)atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p producers] [-n ops_per_producer]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!max_producers || !ops) return 1;
+
+    printf("layout,mode,producers,ops_per_sec");
+    for (uint32_t i=0; i<ARRAY_SIZE(counters); i++) printf(",%s_per_cmd", counters[i].name);
+    printf("\n");
+    for (uint32_t m=0; m<ARRAY_SIZE(modes); m++) {
+        for (uint32_t p=1; p<=max_producers; p *= 2) run(modes[m].name, modes[m].flags, p);
+    }
+    return 0;
+}
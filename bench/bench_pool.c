@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "cmdqueue.h"
+#include "util.h"
+
+// async throughput of cmdqueue_create_pool with 1..ncpu workers
+
+#define NUM_COMMANDS 256
+
+typedef enum {
+    Load_Cpu,
+    Load_Sleep,
+} Load;
+
+typedef struct {
+    Cmd cmd;
+    Load load;
+} BenchCmd;
+
+static uint64_t completed;
+
+static void callback(void* cookie, Cmd* c) {
+    BenchCmd* cmd = to_container(BenchCmd, cmd, c);
+    switch (cmd->load) {
+    case Load_Cpu: {
+        volatile uint64_t x = 0;
+        for (uint32_t i=0; i<20000; i++) x += i * i;
+        break;
+    }
+    case Load_Sleep:
+        usleep(200);
+        break;
+    }
+    __atomic_add_fetch(&completed, 1, __ATOMIC_RELEASE);
+}
+
+static void run(Load load, uint32_t num_workers, uint32_t num_cmds) {
+    CmdQueue* queue = cmdqueue_create_pool("bench_pool", callback, NULL, NUM_COMMANDS, sizeof(BenchCmd), num_workers);
+    completed = 0;
+
+    uint64_t start = now_ns();
+    for (uint32_t i=0; i<num_cmds; i++) {
+        BenchCmd* cmd = (BenchCmd*)cmdqueue_getcmd_sync(queue);
+        cmd->load = load;
+        cmdqueue_async_cmd(queue, &cmd->cmd);
+    }
+    while (__atomic_load_n(&completed, __ATOMIC_ACQUIRE) != num_cmds) usleep(100);
+    uint64_t elapsed = now_ns() - start;
+
+    printf("%s,%u,%u,%.0f\n", load == Load_Cpu ? "cpu" : "sleep", num_workers, num_cmds,
+           (double)num_cmds * 1e9 / (double)elapsed);
+    cmdqueue_destroy(queue);
+}
+
+int main(int argc, const char* argv[]) {
+    uint32_t ncpu = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+
+    printf("load,workers,commands,cmds_per_sec\n");
+    for (uint32_t w=1; ; w *= 2) {
+        if (w > ncpu) w = ncpu;
+        run(Load_Cpu, w, 20000);
+        run(Load_Sleep, w, 5000);
+        if (w == ncpu) break;
+    }
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "cmdqueue.h"
+#include "util.h"
+
+// sync round-trip latency as the number of concurrent sync producers grows
+
+#define NUM_ROUNDTRIPS 20000
+
+typedef struct {
+    Cmd cmd;
+    uint32_t value;
+} BenchCmd;
+
+typedef struct {
+    CmdQueue* queue;
+    uint64_t total_ns;
+} Producer;
+
+static void callback(void* cookie, Cmd* c) {
+    BenchCmd* cmd = to_container(BenchCmd, cmd, c);
+    cmd->value++;
+}
+
+static void* producer_func(void* arg) {
+    Producer* p = (Producer*)arg;
+    uint64_t start = now_ns();
+    for (uint32_t i=0; i<NUM_ROUNDTRIPS; i++) {
+        BenchCmd* cmd = (BenchCmd*)cmdqueue_getcmd_sync(p->queue);
+        cmd->value = i;
+        cmdqueue_sync_cmd(p->queue, &cmd->cmd);
+    }
+    p->total_ns = now_ns() - start;
+    return 0;
+}
+
+static void run(uint32_t flags, uint32_t num) {
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags = flags;
+
+    CmdQueue* queue = cmdqueue_create_attr("bench_sync", callback, NULL, num, sizeof(BenchCmd), &attr);
+    Producer* list = calloc(num, sizeof(Producer));
+    pthread_t* tids = calloc(num, sizeof(pthread_t));
+
+    for (uint32_t i=0; i<num; i++) {
+        list[i].queue = queue;
+        pthread_create(&tids[i], 0, producer_func, &list[i]);
+    }
+    uint64_t total = 0;
+    for (uint32_t i=0; i<num; i++) {
+        pthread_join(tids[i], 0);
+        total += list[i].total_ns;
+    }
+    printf("%s,%u,%u,%llu\n", (flags & CMDQUEUE_ATTR_LOCKFREE) ? "lockfree" : "locked",
+           num, num * NUM_ROUNDTRIPS, (unsigned long long)(total / ((uint64_t)num * NUM_ROUNDTRIPS)));
+
+    cmdqueue_destroy(queue);
+    free(tids);
+    free(list);
+}
+
+int main(int argc, const char* argv[]) {
+    static const uint32_t producers[] = { 1, 2, 4, 8, 16, 32, 64 };
+
+    printf("engine,producers,roundtrips,avg_latency_ns\n");
+    for (uint32_t p=0; p<sizeof(producers)/sizeof(producers[0]); p++) {
+        run(0, producers[p]);
+    }
+    for (uint32_t p=0; p<sizeof(producers)/sizeof(producers[0]); p++) {
+        run(CMDQUEUE_ATTR_LOCKFREE, producers[p]);
+    }
+    return 0;
+}
@@ -1,283 +1,2217 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include "cmdqueue.h"
+#include "futex.h"
+#include "hist.h"
+#include "timerwheel.h"
+#include "trace.h"
 #include "util.h"
 
 #define Q_LOCK(q)       PTHREAD_CHK(pthread_mutex_lock(&handle->queues[q].mutex))
 #define Q_UNLOCK(q)     PTHREAD_CHK(pthread_mutex_unlock(&handle->queues[q].mutex))
 #define Q_WAIT(q)       PTHREAD_CHK(pthread_cond_wait(&handle->queues[q].cond, &handle->queues[q].mutex))
+#define Q_SIGNAL(q)     PTHREAD_CHK(pthread_cond_signal(&handle->queues[q].cond))
 #define Q_BROADCAST(q)  PTHREAD_CHK(pthread_cond_broadcast(&handle->queues[q].cond))
 
+#define TRACE(type, idx) \
+    do { if (handle->flags & CMDQUEUE_ATTR_TRACE) trace_event(&handle->trace, type, idx); } while (0)
+
 typedef enum {
     CMDQUEUE_ASYNC = 0x0,
     CMDQUEUE_SYNC  = 0x1,
+    CMDQUEUE_NOTIFY = 0x2,  // async, finished commands go to the completion lane
 } Mode;
 
-typedef enum {
-    CMDQUEUE_PRIO_LOW  = 0x0,
-    CMDQUEUE_PRIO_HIGH = 0x1,
-} Prio;
+typedef enum {
+    CMD_TODO = 0,
+} QueueType;
+
+// internal attr flag, the handle maps a ShmRegion, see cmdqueue_create_shm
+#define CMDQUEUE_SHM    0x80000000
+
+#define CMD_IDX_NONE    0xFFFFFFFF
+#define CMD_NO_DEADLINE UINT64_MAX
+
+// the lock-free engine only keeps two lanes
+#define MPSC_LANE(prio) ((prio) != CMDQUEUE_PRIO_LOW)
+
+#define CMD_FLAG_KEYED      0x1     // Cmd.key is valid and owns a Strand
+#define CMD_FLAG_QUEUED     0x2     // in one of the TODO lanes
+#define CMD_FLAG_TIMER      0x4     // in the timer wheel
+#define CMD_FLAG_PERIODIC   0x8
+#define CMD_FLAG_CANCELLED  0x10    // periodic command cancelled while running
+#define CMD_FLAG_COALESCE   0x20    // Cmd.key is in the coalesce index while queued
+
+// Cmd.state for sync commands, only the waiter and the worker touch it
+typedef enum {
+    CMD_STATE_PENDING = 0,
+    CMD_STATE_WAITING,      // waiter is (about to be) asleep on the futex
+    CMD_STATE_DONE,
+    CMD_STATE_ABANDONED,    // waiter timed out while it ran, the worker releases it
+    CMD_STATE_GROUPED,      // cmdqueue_wait_all sleeps on Cmd.group
+    CMD_STATE_CANCELLED,    // final like DONE, but the callback never ran
+} CmdState;
+
+static inline int32_t cmd_finished(uint32_t state)
+{
+    return state == CMD_STATE_DONE || state == CMD_STATE_CANCELLED;
+}
+
+#define PRIO_WORDS      (CMDQUEUE_PRIO_LEVELS / 64)
+
+// every lock and every word written by more than one thread gets its own cache line (CACHE_ALIGNED)
+typedef struct {
+    pthread_mutex_t mutex CACHE_ALIGNED;
+    pthread_cond_t cond;
+    uint64_t lane_map[PRIO_WORDS];                  // bit per non-empty lane
+    uint32_t word_map;                              // bit per non-zero lane_map word
+    uint32_t aging_skipped;                         // dispatches that passed a waiting lower lane
+    uint32_t aging_cursor;                          // lane aging served or checked last
+    struct list_tag lanes[CMDQUEUE_PRIO_LEVELS];    // list of commands per priority
+    CmdQueueLaneStats lane_stats[CMDQUEUE_PRIO_LEVELS];
+} Queue;
+
+// Vyukov intrusive MPSC queue, linked through Cmd.head.next
+typedef struct {
+    Cmd* head CACHE_ALIGNED;    // producers exchange here
+    Cmd* tail CACHE_ALIGNED;    // worker only
+    Cmd stub;
+} Mpsc;
+
+// per key serialization for a worker pool, exists while a command of that key is queued or running
+typedef struct Strand_ {
+    struct Strand_* next;       // hash chain or free list
+    struct list_tag active;     // CmdQueue.strand_active while it exists
+    uint64_t key;
+    struct list_tag pending;    // commands waiting for the queued/running one
+} Strand;
+
+// slots of one size, allocated a chunk at a time. Slot indices of chunk c are
+// base + c*chunk_cmds onwards, whether the chunk is allocated or not
+typedef struct {
+    uint64_t free_top CACHE_ALIGNED;    // aba tag << 32 | index of the top free slot
+    uint32_t size CACHE_ALIGNED;
+    uint32_t base;
+    uint32_t chunk_cmds;
+    uint32_t num_chunks;    // cap
+    uint32_t min_chunks;    // allocated at create, cmdqueue_shrink keeps them
+    uint32_t live_chunks;   // written under pool_mutex
+    size_t chunk_bytes;     // mapping size with CMDQUEUE_ATTR_HUGEPAGES/PREFAULT
+    void** chunks;          // num_chunks entries, NULL while not allocated
+    uint32_t* chunk_free;   // cmdqueue_shrink scratch, free slots per chunk
+} SizeClass;
+
+#define SHM_MAGIC       0x51444d43  // "CMDQ"
+#define SHM_VERSION     1
+
+// the part of a shm queue that every process maps, all links are slot indices. Other processes can
+// write any of it, so every index read from it is checked against the handle's own num_commands
+typedef struct {
+    uint32_t magic;                     // written last by the creator
+    uint32_t version;                   // SHM_VERSION
+    uint32_t header_size;               // sizeof(ShmRegion), differs with -DCMDQUEUE_PACKED
+    uint32_t num_commands;
+    uint32_t size_cmd;
+    uint32_t slab_offset;               // slot i starts at slab_offset + i*size_cmd
+    uint32_t timestamps;                // the worker keeps stats, every producer fills Cmd.enqueue_ns
+    uint64_t free_top CACHE_ALIGNED;    // aba tag << 32 | index of the top free slot
+    uint32_t free_waiters CACHE_ALIGNED;
+    uint32_t free_seq;                  // futex word
+    uint32_t lanes[2] CACHE_ALIGNED;    // low, high: index stacks, newest first, the worker takes them whole
+    uint32_t parked CACHE_ALIGNED;      // futex word, worker sleeps on empty lanes
+    uint32_t next[];                    // per slot, free stack or lane link
+} ShmRegion;
+
+// per thread cache of free size_cmd commands, refilled from and flushed to the free stack in halves
+typedef struct Magazine_ {
+    struct Magazine_* next;     // every magazine of the queue, freed by cmdqueue_destroy
+    CmdQueue* handle;
+    uint32_t count;
+    Cmd* cmds[];
+} Magazine;
+
+struct CmdQueue_ {
+    // read mostly
+    uint32_t flags;         // CMDQUEUE_ATTR_*
+    const char* name;       // no ownership
+    pthread_t* tids;
+    uint32_t num_workers;
+    int32_t stop;
+    void* cookie;
+    void (*cmd_callback)(void* cookie, Cmd*  cmd);
+    void (*cmd_batch_callback)(void* cookie, Cmd** cmds, uint32_t n);
+    void (*cmd_merge_callback)(void* cookie, Cmd* pending, Cmd* cmd);
+    uint32_t batch_size;    // max commands per worker dequeue
+    uint32_t aging_ratio;
+    uint64_t aging_max_wait_ns;
+    int32_t timestamps;     // fill Cmd.enqueue_ns
+    int done_fd;            // eventfd, -1 without CMDQUEUE_ATTR_COMPLETION
+    uint32_t num_classes;
+    Cmd** slots;            // slot index to command, all classes, stale for slots of a freed chunk
+    uint32_t* free_next;    // free index stack links, per slot
+    Strand* strands;        // num_commands entries, only with num_workers > 1
+    Strand** strand_hash;
+    uint32_t strand_mask;
+    uint32_t* coalesce_hash;    // bucket heads, slot index chains through coalesce_next
+    uint32_t* coalesce_next;
+    uint32_t coalesce_mask;
+    uint64_t timer_tick_ns;
+    uint64_t spin_max_ns;
+    uint32_t magazine_size; // 0 = no magazines
+    pthread_key_t magazine_key;
+    Magazine* magazines;    // prepend only
+    ShmRegion* shm;         // CMDQUEUE_SHM only
+    uint8_t* shm_slab;
+    uint32_t shm_commands;  // checked copies of the ShmRegion fields
+    uint32_t shm_size_cmd;
+    size_t shm_size;
+    char* shm_path;         // owned, unlinked by the creator's cmdqueue_destroy
+    int32_t shm_owner;
+    int32_t sched_error;    // first pthread_setschedparam error of the workers, see cmdqueue_sched_error
+    uint32_t shm_pending[2];    // worker only, lane commands taken off the stacks, oldest first
+
+    Queue queues[1];        // CMD_TODO
+    Strand* strand_free;    // protected by CMD_TODO
+    struct list_tag strand_active;  // strands in use, protected by CMD_TODO
+    TimerWheel wheel;       // protected by CMD_TODO
+    Mpsc lanes[2];          // low, any higher prio (CMDQUEUE_ATTR_LOCKFREE only)
+    uint32_t parked CACHE_ALIGNED;  // futex word, worker sleeps on empty lanes (CMDQUEUE_ATTR_LOCKFREE only)
+    Mpsc done;              // finished notify commands, workers push, cmdqueue_reap pops
+    uint32_t done_armed CACHE_ALIGNED;  // the reaper drained done and wants an eventfd write
+    SizeClass classes[1 + CMDQUEUE_SIZE_CLASSES];  // size_cmd first, then attr->size_classes
+    uint32_t free_waiters CACHE_ALIGNED;    // threads blocked in cmdqueue_getcmd_sync
+    uint32_t free_seq;      // futex word, bumped on release while someone waits
+    pthread_mutex_t pool_mutex CACHE_ALIGNED;   // grow and shrink
+    uint64_t spin_sync_ns CACHE_ALIGNED;    // average wait per site, relaxed, feeds spin_budget
+    uint64_t spin_pool_ns;
+    uint64_t spin_worker_ns;
+    CmdQueueStats stats CACHE_ALIGNED;  // CMDQUEUE_ATTR_STATS only, relaxed atomics
+    Trace trace;            // CMDQUEUE_ATTR_TRACE only
+};
+
+static inline Cmd* cmd_at(const CmdQueue* handle, uint32_t idx)
+{
+    return handle->slots[idx];
+}
+
+static inline SizeClass* slot_class(CmdQueue* handle, uint32_t idx)
+{
+    uint32_t c = handle->num_classes - 1;
+    while (idx < handle->classes[c].base) c--;
+    return &handle->classes[c];
+}
+
+static Cmd* freelist_pop(CmdQueue* handle, SizeClass* cls)
+{
+    uint64_t top = __atomic_load_n(&cls->free_top, __ATOMIC_SEQ_CST);
+    while (1) {
+        uint32_t idx = (uint32_t)top;
+        if (idx == CMD_IDX_NONE) return NULL;
+
+        // next may be stale when another thread won the race, the tag makes the CAS fail then
+        uint32_t next = __atomic_load_n(&handle->free_next[idx], __ATOMIC_RELAXED);
+        uint64_t new_top = (((top >> 32) + 1) << 32) | next;
+        if (__atomic_compare_exchange_n(&cls->free_top, &top, new_top, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return cmd_at(handle, idx);
+        }
+    }
+}
+
+static uint32_t freelist_pop_batch(CmdQueue* handle, SizeClass* cls, Cmd** cmds, uint32_t n)
+{
+    uint64_t top = __atomic_load_n(&cls->free_top, __ATOMIC_SEQ_CST);
+    while (1) {
+        uint32_t idx = (uint32_t)top;
+        uint32_t count = 0;
+        while (idx != CMD_IDX_NONE && count < n) {
+            cmds[count++] = cmd_at(handle, idx);
+            idx = __atomic_load_n(&handle->free_next[idx], __ATOMIC_RELAXED);
+        }
+        if (!count) return 0;
+
+        uint64_t new_top = (((top >> 32) + 1) << 32) | idx;
+        if (__atomic_compare_exchange_n(&cls->free_top, &top, new_top, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return count;
+        }
+    }
+}
+
+// pushes the chain first .. last, already linked through free_next
+static void freelist_push_chain(CmdQueue* handle, SizeClass* cls, uint32_t first, uint32_t last)
+{
+    uint64_t top = __atomic_load_n(&cls->free_top, __ATOMIC_RELAXED);
+    uint64_t new_top;
+    do {
+        __atomic_store_n(&handle->free_next[last], (uint32_t)top, __ATOMIC_RELAXED);
+        new_top = (((top >> 32) + 1) << 32) | first;
+    } while (!__atomic_compare_exchange_n(&cls->free_top, &top, new_top, 1,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+}
+
+static void freelist_wake(CmdQueue* handle, uint32_t n)
+{
+    if (__atomic_load_n(&handle->free_waiters, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&handle->free_seq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&handle->free_seq, (int32_t)n);
+    }
+}
+
+static inline Cmd* shm_cmd(const CmdQueue* handle, uint32_t idx)
+{
+    return (Cmd*)(handle->shm_slab + (size_t)idx * handle->shm_size_cmd);
+}
+
+// from the address, Cmd.idx lives in the shared slab too
+static inline uint32_t shm_idx(const CmdQueue* handle, const Cmd* cmd)
+{
+    size_t offset = (size_t)((const uint8_t*)cmd - handle->shm_slab);
+    assert(offset % handle->shm_size_cmd == 0 && offset / handle->shm_size_cmd < handle->shm_commands);
+    return (uint32_t)(offset / handle->shm_size_cmd);
+}
+
+static Cmd* shm_pop(CmdQueue* handle)
+{
+    ShmRegion* shm = handle->shm;
+    uint64_t top = __atomic_load_n(&shm->free_top, __ATOMIC_SEQ_CST);
+    while (1) {
+        uint32_t idx = (uint32_t)top;
+        // also a corrupted stack, it looks empty
+        if (idx >= handle->shm_commands) return NULL;
+
+        uint32_t next = __atomic_load_n(&shm->next[idx], __ATOMIC_RELAXED);
+        uint64_t new_top = (((top >> 32) + 1) << 32) | next;
+        if (__atomic_compare_exchange_n(&shm->free_top, &top, new_top, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return shm_cmd(handle, idx);
+        }
+    }
+}
+
+static void shm_push_batch(CmdQueue* handle, Cmd** cmds, uint32_t n)
+{
+    ShmRegion* shm = handle->shm;
+    for (uint32_t i=0; i<n-1; i++) {
+        __atomic_store_n(&shm->next[shm_idx(handle, cmds[i])], shm_idx(handle, cmds[i+1]), __ATOMIC_RELAXED);
+    }
+    uint32_t first = shm_idx(handle, cmds[0]);
+    uint32_t last = shm_idx(handle, cmds[n-1]);
+    uint64_t top = __atomic_load_n(&shm->free_top, __ATOMIC_RELAXED);
+    uint64_t new_top;
+    do {
+        __atomic_store_n(&shm->next[last], (uint32_t)top, __ATOMIC_RELAXED);
+        new_top = (((top >> 32) + 1) << 32) | first;
+    } while (!__atomic_compare_exchange_n(&shm->free_top, &top, new_top, 1,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    if (__atomic_load_n(&shm->free_waiters, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&shm->free_seq, 1, __ATOMIC_SEQ_CST);
+        futex_wake_shared(&shm->free_seq, (int32_t)n);
+    }
+}
+
+static Cmd* shm_getcmd_wait(CmdQueue* handle, uint64_t deadline_ns)
+{
+    ShmRegion* shm = handle->shm;
+    Cmd* cmd = shm_pop(handle);
+    if (cmd) return cmd;
+
+    __atomic_add_fetch(&shm->free_waiters, 1, __ATOMIC_SEQ_CST);
+    while (1) {
+        uint32_t seq = __atomic_load_n(&shm->free_seq, __ATOMIC_SEQ_CST);
+        cmd = shm_pop(handle);
+        if (cmd) break;
+        if (deadline_ns == CMD_NO_DEADLINE) {
+            futex_wait_shared(&shm->free_seq, seq);
+        } else if (futex_wait_until_shared(&shm->free_seq, seq, deadline_ns) == ETIMEDOUT) {
+            cmd = shm_pop(handle);
+            break;
+        }
+    }
+    __atomic_sub_fetch(&shm->free_waiters, 1, __ATOMIC_SEQ_CST);
+    return cmd;
+}
+
+static void freelist_push_batch(CmdQueue* handle, Cmd** cmds, uint32_t n)
+{
+    if (!n) return;
+    if (handle->flags & CMDQUEUE_SHM) {
+        shm_push_batch(handle, cmds, n);
+        return;
+    }
+
+    // one chain per run of the same size class
+    SizeClass* cls = slot_class(handle, cmds[0]->idx);
+    uint32_t start = 0;
+    for (uint32_t i=1; i<=n; i++) {
+        SizeClass* next = (i < n) ? slot_class(handle, cmds[i]->idx) : NULL;
+        if (next == cls) {
+            __atomic_store_n(&handle->free_next[cmds[i-1]->idx], cmds[i]->idx, __ATOMIC_RELAXED);
+            continue;
+        }
+        freelist_push_chain(handle, cls, cmds[start]->idx, cmds[i-1]->idx);
+        cls = next;
+        start = i;
+    }
+    freelist_wake(handle, n);
+}
+
+static void freelist_push(CmdQueue* handle, Cmd* cmd)
+{
+    freelist_push_batch(handle, &cmd, 1);
+}
+
+#define HUGEPAGE_SIZE   (2u << 20)
+
+static void* chunk_mem_alloc(const CmdQueue* handle, const SizeClass* cls)
+{
+    if (!(handle->flags & (CMDQUEUE_ATTR_HUGEPAGES | CMDQUEUE_ATTR_PREFAULT))) {
+        void* mem = NULL;
+        size_t align = (handle->flags & CMDQUEUE_ATTR_ALIGN) ? CACHE_LINE : sizeof(void*);
+        PTHREAD_CHK(posix_memalign(&mem, align, (size_t)cls->chunk_cmds * cls->size));
+        return mem;
+    }
+
+    int mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (handle->flags & CMDQUEUE_ATTR_PREFAULT) mflags |= MAP_POPULATE;
+    void* mem = MAP_FAILED;
+    // reserved hugepages first, transparent ones when none are left
+    if (handle->flags & CMDQUEUE_ATTR_HUGEPAGES) {
+        mem = mmap(NULL, cls->chunk_bytes, PROT_READ | PROT_WRITE, mflags | MAP_HUGETLB, -1, 0);
+    }
+    if (mem == MAP_FAILED) {
+        mem = mmap(NULL, cls->chunk_bytes, PROT_READ | PROT_WRITE, mflags, -1, 0);
+        assert(mem != MAP_FAILED);
+        if (handle->flags & CMDQUEUE_ATTR_HUGEPAGES) madvise(mem, cls->chunk_bytes, MADV_HUGEPAGE);
+    }
+    // best effort, RLIMIT_MEMLOCK is often small
+    if (handle->flags & CMDQUEUE_ATTR_PREFAULT) mlock(mem, cls->chunk_bytes);
+    return mem;
+}
+
+static void chunk_mem_free(const CmdQueue* handle, const SizeClass* cls, void* mem)
+{
+    if (handle->flags & (CMDQUEUE_ATTR_HUGEPAGES | CMDQUEUE_ATTR_PREFAULT)) {
+        munmap(mem, cls->chunk_bytes);
+    } else {
+        free(mem);
+    }
+}
+
+// allocates chunk c of cls and pushes its slots, pool_mutex held
+static void chunk_alloc(CmdQueue* handle, SizeClass* cls, uint32_t c)
+{
+    uint8_t* chunk = chunk_mem_alloc(handle, cls);
+    assert(chunk);
+    uint32_t first = cls->base + c * cls->chunk_cmds;
+    for (uint32_t i=0; i<cls->chunk_cmds; i++) {
+        Cmd* cmd = (Cmd*)(chunk + (size_t)i * cls->size);
+        cmd->idx = first + i;
+        handle->slots[first + i] = cmd;
+        handle->free_next[first + i] = first + i + 1;
+    }
+    cls->chunks[c] = chunk;
+    __atomic_store_n(&cls->live_chunks, cls->live_chunks + 1, __ATOMIC_RELAXED);
+    freelist_push_chain(handle, cls, first, first + cls->chunk_cmds - 1);
+}
+
+#define SPIN_CHECK_MASK 63      // iterations between clock reads
+
+// how long to spin before parking, 0 when this site's waits are too long to be worth it
+static uint64_t spin_budget(const CmdQueue* handle, const uint64_t* avg_ns)
+{
+    uint64_t avg = __atomic_load_n(avg_ns, __ATOMIC_RELAXED);
+    if (!handle->spin_max_ns || avg > handle->spin_max_ns) return 0;
+    return (2 * avg + 1000 < handle->spin_max_ns) ? 2 * avg + 1000 : handle->spin_max_ns;
+}
+
+// feeds the whole wait, spun or parked, into the average with weight 1/8
+static void spin_learn(uint64_t* avg_ns, uint64_t waited_ns)
+{
+    uint64_t avg = __atomic_load_n(avg_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(avg_ns, avg - avg / 8 + waited_ns / 8, __ATOMIC_RELAXED);
+}
+
+static inline void stats_add(CmdQueue* handle, uint64_t* counter, int64_t n)
+{
+    if (handle->flags & CMDQUEUE_ATTR_STATS) __atomic_add_fetch(counter, (uint64_t)n, __ATOMIC_RELAXED);
+}
+
+// makes sure cls has a free slot unless it is at its cap, returns 0 then
+static int32_t pool_grow(CmdQueue* handle, SizeClass* cls)
+{
+    if (__atomic_load_n(&cls->live_chunks, __ATOMIC_RELAXED) == cls->num_chunks) return 0;
+
+    int32_t grown = 0;
+    PTHREAD_CHK(pthread_mutex_lock(&handle->pool_mutex));
+    // a release or another grower may have beaten us to it
+    if ((uint32_t)__atomic_load_n(&cls->free_top, __ATOMIC_SEQ_CST) != CMD_IDX_NONE) {
+        grown = 1;
+    } else {
+        for (uint32_t c=0; c<cls->num_chunks && !grown; c++) {
+            if (cls->chunks[c]) continue;
+            chunk_alloc(handle, cls, c);
+            stats_add(handle, &handle->stats.pool_bytes, (int64_t)cls->chunk_cmds * cls->size);
+            grown = 1;
+        }
+    }
+    PTHREAD_CHK(pthread_mutex_unlock(&handle->pool_mutex));
+    return grown;
+}
+
+static Cmd* pool_pop(CmdQueue* handle, SizeClass* cls)
+{
+    Cmd* cmd = freelist_pop(handle, cls);
+    while (!cmd && pool_grow(handle, cls)) cmd = freelist_pop(handle, cls);
+    return cmd;
+}
+
+// thread exit, the commands go back but the magazine stays on the list until cmdqueue_destroy
+static void magazine_exit(void* arg)
+{
+    Magazine* mag = (Magazine*)arg;
+    freelist_push_batch(mag->handle, mag->cmds, mag->count);
+    mag->count = 0;
+}
+
+static Magazine* magazine_get(CmdQueue* handle)
+{
+    Magazine* mag = pthread_getspecific(handle->magazine_key);
+    if (mag) return mag;
+
+    mag = malloc(sizeof(Magazine) + handle->magazine_size * sizeof(Cmd*));
+    assert(mag);
+    mag->handle = handle;
+    mag->count = 0;
+    mag->next = __atomic_load_n(&handle->magazines, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&handle->magazines, &mag->next, mag, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    PTHREAD_CHK(pthread_setspecific(handle->magazine_key, mag));
+    return mag;
+}
+
+static Cmd* magazine_pop(CmdQueue* handle)
+{
+    Magazine* mag = magazine_get(handle);
+    if (!mag->count) {
+        SizeClass* cls = &handle->classes[0];
+        uint32_t refill = (handle->magazine_size + 1) / 2;
+        mag->count = freelist_pop_batch(handle, cls, mag->cmds, refill);
+        while (!mag->count && pool_grow(handle, cls)) mag->count = freelist_pop_batch(handle, cls, mag->cmds, refill);
+        if (!mag->count) return NULL;
+    }
+    return mag->cmds[--mag->count];
+}
+
+// releases from producer threads (sync waiters, cmdqueue_putcmd), the workers push in batches anyway
+static void magazine_put(CmdQueue* handle, Cmd* cmd)
+{
+    if (!handle->magazine_size || slot_class(handle, cmd->idx) != &handle->classes[0]) {
+        freelist_push(handle, cmd);
+        return;
+    }
+
+    Magazine* mag = magazine_get(handle);
+    // blocked getcmd callers cannot see into magazines, hand them everything
+    if (__atomic_load_n(&handle->free_waiters, __ATOMIC_RELAXED)) {
+        mag->cmds[mag->count++] = cmd;
+        freelist_push_batch(handle, mag->cmds, mag->count);
+        mag->count = 0;
+        return;
+    }
+    if (mag->count == handle->magazine_size) {
+        // the older half goes, the recently touched ones stay
+        uint32_t half = (handle->magazine_size + 1) / 2;
+        freelist_push_batch(handle, mag->cmds, half);
+        mag->count -= half;
+        memmove(mag->cmds, mag->cmds + half, mag->count * sizeof(Cmd*));
+    }
+    mag->cmds[mag->count++] = cmd;
+}
+
+// the pool fast path, no shared cache line touched while the magazine has commands
+static inline Cmd* getcmd_fast(CmdQueue* handle, SizeClass* cls)
+{
+    if (handle->magazine_size && cls == &handle->classes[0]) return magazine_pop(handle);
+    return pool_pop(handle, cls);
+}
+
+void cmdqueue_magazine_flush(CmdQueue* handle)
+{
+    if (!handle->magazine_size) return;
+    Magazine* mag = pthread_getspecific(handle->magazine_key);
+    if (!mag) return;
+    freelist_push_batch(handle, mag->cmds, mag->count);
+    mag->count = 0;
+}
+
+static Cmd* getcmd_wait(CmdQueue* handle, SizeClass* cls, uint64_t deadline_ns)
+{
+    if (handle->flags & CMDQUEUE_SHM) return shm_getcmd_wait(handle, deadline_ns);
+    Cmd* cmd = getcmd_fast(handle, cls);
+    if (!cmd) {
+        uint64_t start = ((handle->flags & CMDQUEUE_ATTR_STATS) || handle->spin_max_ns) ? now_ns() : 0;
+        stats_add(handle, &handle->stats.pool_empty, 1);
+        TRACE(TRACE_POOL_BLOCK, CMD_IDX_NONE);
+
+        uint64_t budget = spin_budget(handle, &handle->spin_pool_ns);
+        for (uint32_t i=1; budget; i++) {
+            cpu_relax();
+            if ((uint32_t)__atomic_load_n(&cls->free_top, __ATOMIC_RELAXED) != CMD_IDX_NONE &&
+                (cmd = freelist_pop(handle, cls)) != NULL) break;
+            if (!(i & SPIN_CHECK_MASK) && now_ns() - start >= budget) break;
+        }
+        if (!cmd) {
+            __atomic_add_fetch(&handle->free_waiters, 1, __ATOMIC_SEQ_CST);
+            while (1) {
+                uint32_t seq = __atomic_load_n(&handle->free_seq, __ATOMIC_SEQ_CST);
+                // a shrink may have given chunks back since the class hit its cap
+                cmd = pool_pop(handle, cls);
+                if (cmd) break;
+                if (deadline_ns == CMD_NO_DEADLINE) {
+                    futex_wait(&handle->free_seq, seq);
+                } else if (futex_wait_until(&handle->free_seq, seq, deadline_ns) == ETIMEDOUT) {
+                    cmd = freelist_pop(handle, cls);
+                    break;
+                }
+            }
+            __atomic_sub_fetch(&handle->free_waiters, 1, __ATOMIC_SEQ_CST);
+        }
+        if (handle->spin_max_ns) spin_learn(&handle->spin_pool_ns, now_ns() - start);
+        if (handle->flags & CMDQUEUE_ATTR_STATS) hist_record(&handle->stats.pool_wait, now_ns() - start);
+        TRACE(TRACE_POOL_UNBLOCK, CMD_IDX_NONE);
+        if (!cmd) return NULL;
+    }
+    TRACE(TRACE_GETCMD, cmd->idx);
+    return cmd;
+}
+
+Cmd* cmdqueue_getcmd_sync(CmdQueue* handle)
+{
+    return getcmd_wait(handle, &handle->classes[0], CMD_NO_DEADLINE);
+}
+
+Cmd* cmdqueue_getcmd_timed(CmdQueue* handle, uint64_t deadline_ns)
+{
+    return getcmd_wait(handle, &handle->classes[0], deadline_ns);
+}
+
+Cmd* cmdqueue_getcmd_sized(CmdQueue* handle, uint32_t bytes)
+{
+    assert(!(handle->flags & CMDQUEUE_SHM));
+    for (uint32_t c=0; c<handle->num_classes; c++) {
+        if (handle->classes[c].size >= bytes) return getcmd_wait(handle, &handle->classes[c], CMD_NO_DEADLINE);
+    }
+    return NULL;
+}
+
+Cmd* cmdqueue_getcmd_async(CmdQueue* handle)
+{
+    Cmd* cmd = (handle->flags & CMDQUEUE_SHM) ? shm_pop(handle) : getcmd_fast(handle, &handle->classes[0]);
+    if (!cmd) {
+        stats_add(handle, &handle->stats.pool_empty, 1);
+    } else {
+        TRACE(TRACE_GETCMD, cmd->idx);
+    }
+    return cmd;
+}
+
+uint32_t cmdqueue_getcmd_batch(CmdQueue* handle, Cmd** cmds, uint32_t n)
+{
+    assert(!(handle->flags & CMDQUEUE_SHM));
+    SizeClass* cls = &handle->classes[0];
+    uint32_t count = freelist_pop_batch(handle, cls, cmds, n);
+    while (count < n && pool_grow(handle, cls)) count += freelist_pop_batch(handle, cls, cmds + count, n - count);
+    if (count < n) stats_add(handle, &handle->stats.pool_empty, 1);
+    for (uint32_t i=0; i<count; i++) TRACE(TRACE_GETCMD, cmds[i]->idx);
+    return count;
+}
+
+uint32_t cmdqueue_shrink(CmdQueue* handle)
+{
+    uint32_t freed = 0;
+    PTHREAD_CHK(pthread_mutex_lock(&handle->pool_mutex));
+    for (uint32_t k=0; k<handle->num_classes; k++) {
+        SizeClass* cls = &handle->classes[k];
+        if (cls->live_chunks == cls->min_chunks) continue;
+
+        // detach the whole stack, getcmd callers meanwhile see an empty class and queue up on pool_mutex
+        uint64_t top = __atomic_load_n(&cls->free_top, __ATOMIC_SEQ_CST);
+        while (!__atomic_compare_exchange_n(&cls->free_top, &top, (((top >> 32) + 1) << 32) | CMD_IDX_NONE, 1,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+        for (uint32_t c=0; c<cls->num_chunks; c++) cls->chunk_free[c] = 0;
+        for (uint32_t idx=(uint32_t)top; idx != CMD_IDX_NONE; idx = handle->free_next[idx]) {
+            cls->chunk_free[(idx - cls->base) / cls->chunk_cmds]++;
+        }
+
+        // a chunk is idle when all its slots are on the stack, chunk_free becomes a drop flag
+        uint32_t live = cls->live_chunks;
+        for (uint32_t c=0; c<cls->num_chunks; c++) {
+            int32_t idle = cls->chunks[c] && cls->chunk_free[c] == cls->chunk_cmds && live > cls->min_chunks;
+            if (idle) live--;
+            cls->chunk_free[c] = idle;
+        }
+
+        uint32_t dropped = freed;
+        uint32_t first = CMD_IDX_NONE;
+        uint32_t last = CMD_IDX_NONE;
+        for (uint32_t idx=(uint32_t)top; idx != CMD_IDX_NONE; idx = handle->free_next[idx]) {
+            if (cls->chunk_free[(idx - cls->base) / cls->chunk_cmds]) continue;
+            if (last == CMD_IDX_NONE) {
+                first = idx;
+            } else {
+                handle->free_next[last] = idx;
+            }
+            last = idx;
+        }
+        for (uint32_t c=0; c<cls->num_chunks; c++) {
+            if (!cls->chunk_free[c]) continue;
+            chunk_mem_free(handle, cls, cls->chunks[c]);
+            cls->chunks[c] = NULL;
+            stats_add(handle, &handle->stats.pool_bytes, -(int64_t)cls->chunk_cmds * cls->size);
+            freed++;
+        }
+        __atomic_store_n(&cls->live_chunks, live, __ATOMIC_RELAXED);
+        if (last != CMD_IDX_NONE) freelist_push_chain(handle, cls, first, last);
+        // also when nothing went back: a waiter that found the class at its cap can grow it again
+        if (last != CMD_IDX_NONE || freed != dropped) freelist_wake(handle, INT32_MAX);
+    }
+    PTHREAD_CHK(pthread_mutex_unlock(&handle->pool_mutex));
+    return freed;
+}
+
+// single writer per entry at any time (TODO lock or the lock-free worker), readers may run concurrently
+static void lane_account(CmdQueue* handle, const Cmd* cmd, uint64_t now, int32_t aged)
+{
+    if (!(handle->flags & CMDQUEUE_ATTR_STATS)) return;
+
+    CmdQueueLaneStats* stats = &handle->queues[CMD_TODO].lane_stats[cmd->prio];
+    uint64_t wait = now - cmd->enqueue_ns;
+    __atomic_store_n(&stats->dispatched, stats->dispatched + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->wait_total_ns, stats->wait_total_ns + wait, __ATOMIC_RELAXED);
+    if (wait > stats->wait_max_ns) __atomic_store_n(&stats->wait_max_ns, wait, __ATOMIC_RELAXED);
+    if (aged) __atomic_store_n(&stats->aged, stats->aged + 1, __ATOMIC_RELAXED);
+    hist_record(&handle->stats.wait, wait);
+}
+
+static void mpsc_init(Mpsc* q)
+{
+    q->stub.head.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+}
+
+static void mpsc_push(Mpsc* q, Cmd* cmd)
+{
+    cmd->head.next = NULL;
+    Cmd* prev = __atomic_exchange_n(&q->head, cmd, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&prev->head.next, &cmd->head, __ATOMIC_RELEASE);
+}
+
+// cmds are linked up front so the whole batch is published with one exchange
+static void mpsc_push_batch(Mpsc* q, Cmd** cmds, uint32_t n)
+{
+    for (uint32_t i=0; i<n-1; i++) {
+        cmds[i]->head.next = &cmds[i+1]->head;
+    }
+    cmds[n-1]->head.next = NULL;
+    Cmd* prev = __atomic_exchange_n(&q->head, cmds[n-1], __ATOMIC_SEQ_CST);
+    __atomic_store_n(&prev->head.next, &cmds[0]->head, __ATOMIC_RELEASE);
+}
+
+static int32_t mpsc_empty(Mpsc* q)
+{
+    return __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == &q->stub;
+}
+
+// returns NULL when empty or when a producer is halfway a push
+static Cmd* mpsc_pop(Mpsc* q)
+{
+    Cmd* tail = q->tail;
+    Cmd* next = (Cmd*)__atomic_load_n(&tail->head.next, __ATOMIC_ACQUIRE);
+
+    if (tail == &q->stub) {
+        if (!next) return NULL;
+        q->tail = next;
+        tail = next;
+        next = (Cmd*)__atomic_load_n(&next->head.next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) return NULL;
+
+    mpsc_push(q, &q->stub);
+    next = (Cmd*)__atomic_load_n(&tail->head.next, __ATOMIC_ACQUIRE);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void lockfree_wakeup(CmdQueue* handle)
+{
+    // only pay for the syscall when the worker actually parked
+    if (__atomic_load_n(&handle->parked, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&handle->parked, 0, __ATOMIC_SEQ_CST)) {
+        futex_wake(&handle->parked, 1);
+    }
+}
+
+static uint32_t lockfree_next_cmds(CmdQueue* handle, Cmd** cmds, uint32_t max)
+{
+    Mpsc* prio = &handle->lanes[MPSC_LANE(CMDQUEUE_PRIO_HIGH)];
+    Mpsc* normal = &handle->lanes[MPSC_LANE(CMDQUEUE_PRIO_LOW)];
+    uint64_t idle_start = 0;
+
+    while (!__atomic_load_n(&handle->stop, __ATOMIC_ACQUIRE)) {
+        uint32_t count = 0;
+        while (count < max) {
+            Cmd* cmd = mpsc_pop(prio);
+            if (!cmd) cmd = mpsc_pop(normal);
+            if (!cmd) break;
+            cmds[count++] = cmd;
+        }
+        if (count) {
+            if (idle_start) spin_learn(&handle->spin_worker_ns, now_ns() - idle_start);
+            if (handle->timestamps) {
+                uint64_t now = now_ns();
+                for (uint32_t i=0; i<count; i++) {
+                    stats_add(handle, &handle->stats.depth[cmds[i]->prio], -1);
+                    lane_account(handle, cmds[i], now, 0);
+                }
+            }
+            return count;
+        }
+
+        if (!idle_start && handle->spin_max_ns) {
+            idle_start = now_ns();
+            uint64_t budget = spin_budget(handle, &handle->spin_worker_ns);
+            for (uint32_t i=1; budget && mpsc_empty(prio) && mpsc_empty(normal); i++) {
+                cpu_relax();
+                if (!(i & SPIN_CHECK_MASK) && now_ns() - idle_start >= budget) break;
+            }
+            continue;
+        }
+
+        __atomic_store_n(&handle->parked, 1, __ATOMIC_SEQ_CST);
+        if (mpsc_empty(prio) && mpsc_empty(normal) && !__atomic_load_n(&handle->stop, __ATOMIC_SEQ_CST)) {
+            futex_wait(&handle->parked, 1);
+        }
+        __atomic_store_n(&handle->parked, 0, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+static void shm_lane_push_batch(CmdQueue* handle, Cmd** cmds, uint32_t n, uint32_t lane)
+{
+    // pushed newest first, so the worker's reversal restores submission order
+    ShmRegion* shm = handle->shm;
+    for (uint32_t i=n-1; i>0; i--) {
+        __atomic_store_n(&shm->next[shm_idx(handle, cmds[i])], shm_idx(handle, cmds[i-1]), __ATOMIC_RELAXED);
+    }
+    uint32_t first = shm_idx(handle, cmds[0]);
+    uint32_t last = shm_idx(handle, cmds[n-1]);
+    uint32_t top = __atomic_load_n(&shm->lanes[lane], __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&shm->next[first], top, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&shm->lanes[lane], &top, last, 1,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    if (__atomic_load_n(&shm->parked, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&shm->parked, 0, __ATOMIC_SEQ_CST)) {
+        futex_wake_shared(&shm->parked, 1);
+    }
+}
+
+// takes a whole lane stack and returns it oldest first, no aba since nobody else pops.
+// A corrupted stack is cut at the first bad index and after num_commands links, so no loop
+static uint32_t shm_lane_take(CmdQueue* handle, uint32_t lane)
+{
+    ShmRegion* shm = handle->shm;
+    uint32_t idx = __atomic_exchange_n(&shm->lanes[lane], CMD_IDX_NONE, __ATOMIC_SEQ_CST);
+    uint32_t fifo = CMD_IDX_NONE;
+    for (uint32_t n=0; idx < handle->shm_commands && n < handle->shm_commands; n++) {
+        uint32_t next = shm->next[idx];
+        shm->next[idx] = fifo;
+        fifo = idx;
+        idx = next;
+    }
+    return fifo;
+}
+
+static int32_t shm_lanes_empty(CmdQueue* handle)
+{
+    return __atomic_load_n(&handle->shm->lanes[0], __ATOMIC_SEQ_CST) == CMD_IDX_NONE &&
+           __atomic_load_n(&handle->shm->lanes[1], __ATOMIC_SEQ_CST) == CMD_IDX_NONE;
+}
+
+static uint32_t shm_next_cmds(CmdQueue* handle, Cmd** cmds, uint32_t max)
+{
+    ShmRegion* shm = handle->shm;
+    uint32_t* pending = handle->shm_pending;
+
+    while (!__atomic_load_n(&handle->stop, __ATOMIC_ACQUIRE)) {
+        uint32_t count = 0;
+        while (count < max) {
+            uint32_t lane = MPSC_LANE(CMDQUEUE_PRIO_HIGH);
+            if (pending[lane] == CMD_IDX_NONE) pending[lane] = shm_lane_take(handle, lane);
+            if (pending[lane] == CMD_IDX_NONE) {
+                lane = MPSC_LANE(CMDQUEUE_PRIO_LOW);
+                if (pending[lane] == CMD_IDX_NONE) pending[lane] = shm_lane_take(handle, lane);
+                if (pending[lane] == CMD_IDX_NONE) break;
+            }
+            uint32_t idx = pending[lane];
+            if (idx >= handle->shm_commands) {
+                pending[lane] = CMD_IDX_NONE;
+                continue;
+            }
+            pending[lane] = shm->next[idx];
+            cmds[count++] = shm_cmd(handle, idx);
+        }
+        if (count) {
+            if (handle->timestamps) {
+                uint64_t now = now_ns();
+                for (uint32_t i=0; i<count; i++) lane_account(handle, cmds[i], now, 0);
+            }
+            return count;
+        }
+
+        __atomic_store_n(&shm->parked, 1, __ATOMIC_SEQ_CST);
+        if (shm_lanes_empty(handle) && !__atomic_load_n(&handle->stop, __ATOMIC_SEQ_CST)) {
+            futex_wait_shared(&shm->parked, 1);
+        }
+        __atomic_store_n(&shm->parked, 0, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+static inline uint32_t key_hash(uint64_t key)
+{
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+// called with CMD_TODO locked, queued coalesced commands by key
+static uint32_t* coalesce_slot(CmdQueue* handle, uint64_t key)
+{
+    uint32_t* slot = &handle->coalesce_hash[key_hash(key) & handle->coalesce_mask];
+    while (*slot != CMD_IDX_NONE && cmd_at(handle, *slot)->key != key) slot = &handle->coalesce_next[*slot];
+    return slot;
+}
+
+// lane helpers, called with CMD_TODO locked
+static void lane_add(CmdQueue* handle, Cmd* cmd, int32_t front)
+{
+    Queue* q = &handle->queues[CMD_TODO];
+    uint32_t prio = cmd->prio;
+    if (front) {
+        list_add_front(&q->lanes[prio], &cmd->head);
+    } else {
+        list_add_tail(&q->lanes[prio], &cmd->head);
+    }
+    cmd->flags |= CMD_FLAG_QUEUED;
+    stats_add(handle, &handle->stats.depth[prio], 1);
+    q->lane_map[prio / 64] |= 1ull << (prio % 64);
+    q->word_map |= 1u << (prio / 64);
+}
+
+static void lane_remove(CmdQueue* handle, Cmd* cmd)
+{
+    Queue* q = &handle->queues[CMD_TODO];
+    uint32_t prio = cmd->prio;
+    list_remove(&cmd->head);
+    cmd->flags &= ~CMD_FLAG_QUEUED;
+    if (cmd->flags & CMD_FLAG_COALESCE) {
+        // once it left the lane a newer command must run again
+        uint32_t* slot = coalesce_slot(handle, cmd->key);
+        *slot = handle->coalesce_next[cmd->idx];
+        cmd->flags &= ~CMD_FLAG_COALESCE;
+    }
+    stats_add(handle, &handle->stats.depth[prio], -1);
+    if (list_empty(&q->lanes[prio])) {
+        q->lane_map[prio / 64] &= ~(1ull << (prio % 64));
+        if (!q->lane_map[prio / 64]) q->word_map &= ~(1u << (prio / 64));
+    }
+}
+
+static int32_t lanes_empty(const CmdQueue* handle)
+{
+    return handle->queues[CMD_TODO].word_map == 0;
+}
+
+// highest non-empty lane below limit, -1 when there is none
+static int32_t lanes_highest_below(const Queue* q, uint32_t limit)
+{
+    if (!limit) return -1;
+    uint32_t word = (limit - 1) / 64;
+    uint64_t bits = q->lane_map[word] & (~0ull >> (63 - (limit - 1) % 64));
+    if (bits) return (int32_t)(word * 64 + 63 - __builtin_clzll(bits));
+    uint32_t words = q->word_map & ((1u << word) - 1);
+    if (!words) return -1;
+    word = 31 - __builtin_clz(words);
+    return (int32_t)(word * 64 + 63 - __builtin_clzll(q->lane_map[word]));
+}
+
+// O(1) regardless of the number of levels: highest word, then highest lane in it.
+// Aging serves the lanes below the top one round robin, the cursor moves down through the non-empty
+// ones and wraps, so each of them gets a dispatch at least every (aging_ratio + 1) * lanes
+static Cmd* lanes_pop(CmdQueue* handle, uint64_t now)
+{
+    Queue* q = &handle->queues[CMD_TODO];
+    uint32_t word = 31 - __builtin_clz(q->word_map);
+    uint32_t prio = word * 64 + (63 - __builtin_clzll(q->lane_map[word]));
+    int32_t aged = 0;
+
+    if (handle->aging_ratio || handle->aging_max_wait_ns) {
+        uint32_t start = q->aging_cursor < prio ? q->aging_cursor : prio;
+        int32_t next = lanes_highest_below(q, start);
+        if (next < 0 && start < prio) next = lanes_highest_below(q, prio);
+        if (next < 0) {
+            q->aging_skipped = 0;
+        } else {
+            const Cmd* oldest = (const Cmd*)q->lanes[next].next;
+            if ((handle->aging_ratio && q->aging_skipped >= handle->aging_ratio) ||
+                (handle->aging_max_wait_ns && now - oldest->enqueue_ns >= handle->aging_max_wait_ns)) {
+                prio = (uint32_t)next;
+                aged = 1;
+                q->aging_skipped = 0;
+                q->aging_cursor = prio;
+            } else {
+                q->aging_skipped++;
+                // the wait check looks at one lane per dispatch, so it has to move on too
+                if (handle->aging_max_wait_ns) q->aging_cursor = (uint32_t)next;
+            }
+        }
+    }
+
+    // TODO BB to_container
+    Cmd* cmd = (Cmd*)q->lanes[prio].next;
+    lane_remove(handle, cmd);
+    lane_account(handle, cmd, now, aged);
+    return cmd;
+}
+
+static uint64_t cmd_timer_expires(void* ctx, list_t node)
+{
+    const CmdQueue* handle = (const CmdQueue*)ctx;
+    const Cmd* cmd = (const Cmd*)node;
+    return (cmd->deadline_ns + handle->timer_tick_ns - 1) / handle->timer_tick_ns;
+}
+
+// called with CMD_TODO locked
+static void timer_arm(CmdQueue* handle, Cmd* cmd, uint64_t now)
+{
+    if (cmd->deadline_ns <= now) {
+        cmd->enqueue_ns = now;
+        lane_add(handle, cmd, 0);
+        return;
+    }
+    if (!handle->wheel.count) {
+        // idle wheel, catch up with the clock before measuring the delay against it
+        struct list_tag none;
+        list_init(&none);
+        timerwheel_advance(&handle->wheel, now / handle->timer_tick_ns, &none);
+    }
+    cmd->flags |= CMD_FLAG_TIMER;
+    timerwheel_add(&handle->wheel, &cmd->head);
+}
+
+// called with CMD_TODO locked, moves due timers to their lane
+static void timers_expire(CmdQueue* handle, uint64_t now)
+{
+    struct list_tag expired;
+    list_init(&expired);
+    timerwheel_advance(&handle->wheel, now / handle->timer_tick_ns, &expired);
+
+    while (!list_empty(&expired)) {
+        Cmd* cmd = (Cmd*)expired.next;
+        list_remove(&cmd->head);
+        cmd->flags &= ~CMD_FLAG_TIMER;
+        cmd->enqueue_ns = now;
+        lane_add(handle, cmd, 0);
+    }
+}
+
+static void todo_wait_until(CmdQueue* handle, uint64_t deadline_ns)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline_ns / 1000000000ull;
+    ts.tv_nsec = deadline_ns % 1000000000ull;
+    int err = pthread_cond_timedwait(&handle->queues[CMD_TODO].cond, &handle->queues[CMD_TODO].mutex, &ts);
+    assert(err == 0 || err == ETIMEDOUT);
+    (void)err;
+}
+
+static void cmdqueue_schedule_cmd(CmdQueue* handle, Cmd* cmd, uint32_t sync, uint32_t prio)
+{
+    assert(prio < CMDQUEUE_PRIO_LEVELS);
+    cmd->type = sync;
+    cmd->state = CMD_STATE_PENDING;
+    cmd->flags = 0;
+    cmd->prio = prio;
+    if (handle->timestamps) cmd->enqueue_ns = now_ns();
+    TRACE(TRACE_SCHEDULE, cmd->idx);
+
+    if (handle->flags & CMDQUEUE_SHM) {
+        shm_lane_push_batch(handle, &cmd, 1, MPSC_LANE(prio));
+        return;
+    }
+    if (handle->flags & CMDQUEUE_ATTR_LOCKFREE) {
+        stats_add(handle, &handle->stats.depth[prio], 1);
+        mpsc_push(&handle->lanes[MPSC_LANE(prio)], cmd);
+        lockfree_wakeup(handle);
+        return;
+    }
+
+    Q_LOCK(CMD_TODO);
+    lane_add(handle, cmd, 0);
+    Q_SIGNAL(CMD_TODO);
+    Q_UNLOCK(CMD_TODO);
+}
+
+static Strand** strand_slot(CmdQueue* handle, uint64_t key)
+{
+    Strand** slot = &handle->strand_hash[key_hash(key) & handle->strand_mask];
+    while (*slot && (*slot)->key != key) slot = &(*slot)->next;
+    return slot;
+}
+
+// called with CMD_TODO locked, hands the next pending command of the strand to the lanes
+static void strand_advance(CmdQueue* handle, uint64_t key)
+{
+    Strand** slot = strand_slot(handle, key);
+    Strand* strand = *slot;
+    assert(strand);
+
+    if (list_empty(&strand->pending)) {
+        *slot = strand->next;
+        list_remove(&strand->active);
+        strand->next = handle->strand_free;
+        handle->strand_free = strand;
+    } else {
+        // it already waited, keep its place ahead of newer work
+        Cmd* cmd = (Cmd*)strand->pending.next;
+        list_remove(&cmd->head);
+        lane_add(handle, cmd, 1);
+        Q_SIGNAL(CMD_TODO);
+    }
+}
+
+static void cmdqueue_schedule_keyed_cmd(CmdQueue* handle, Cmd* cmd, uint32_t sync, uint64_t key)
+{
+    // a single worker already runs the low prio lane in order, no strand but the key stays visible
+    if (!handle->strand_hash) {
+        cmd->key = key;
+        cmdqueue_schedule_cmd(handle, cmd, sync, CMDQUEUE_PRIO_LOW);
+        return;
+    }
+
+    cmd->type = sync;
+    cmd->state = CMD_STATE_PENDING;
+    cmd->flags = CMD_FLAG_KEYED;
+    cmd->prio = CMDQUEUE_PRIO_LOW;
+    cmd->key = key;
+    if (handle->timestamps) cmd->enqueue_ns = now_ns();
+    TRACE(TRACE_SCHEDULE, cmd->idx);
+    Q_LOCK(CMD_TODO);
+    Strand** slot = strand_slot(handle, key);
+    if (*slot) {
+        list_add_tail(&(*slot)->pending, &cmd->head);
+    } else {
+        Strand* strand = handle->strand_free;
+        assert(strand);
+        handle->strand_free = strand->next;
+        strand->next = NULL;
+        strand->key = key;
+        list_init(&strand->pending);
+        list_add_tail(&handle->strand_active, &strand->active);
+        *slot = strand;
+
+        lane_add(handle, cmd, 0);
+        Q_SIGNAL(CMD_TODO);
+    }
+    Q_UNLOCK(CMD_TODO);
+}
+
+// waiter side of a finished sync command
+static void cmdqueue_release_cmd(CmdQueue* handle, Cmd* cmd)
+{
+    if (handle->flags & CMDQUEUE_ATTR_STATS) hist_record(&handle->stats.sync, now_ns() - cmd->enqueue_ns);
+    TRACE(TRACE_WAKE, cmd->idx);
+    magazine_put(handle, cmd);
+}
+
+// called by a timed out waiter, returns 1 when the caller no longer owns the command
+static int32_t cmdqueue_abandon_cmd(CmdQueue* handle, Cmd* cmd)
+{
+    if (!(handle->flags & (CMDQUEUE_ATTR_LOCKFREE | CMDQUEUE_SHM))) {
+        Q_LOCK(CMD_TODO);
+        int32_t queued = cmd->flags & CMD_FLAG_QUEUED;
+        if (queued) lane_remove(handle, cmd);
+        Q_UNLOCK(CMD_TODO);
+        if (queued) {
+            // never ran
+            freelist_push(handle, cmd);
+            return 1;
+        }
+    }
+
+    // running (or never leaves the lock-free/shm lanes), fails when the worker finished meanwhile
+    uint32_t state = CMD_STATE_WAITING;
+    return __atomic_compare_exchange_n(&cmd->state, &state, CMD_STATE_ABANDONED, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static int32_t cmdqueue_wait_cmd(CmdQueue* handle, Cmd* cmd, uint64_t deadline_ns)
+{
+    uint64_t start = handle->spin_max_ns ? now_ns() : 0;
+    uint64_t budget = spin_budget(handle, &handle->spin_sync_ns);
+    for (uint32_t i=1; budget && !cmd_finished(__atomic_load_n(&cmd->state, __ATOMIC_ACQUIRE)); i++) {
+        cpu_relax();
+        if (!(i & SPIN_CHECK_MASK) && now_ns() - start >= budget) break;
+    }
+
+    uint32_t state = CMD_STATE_PENDING;
+    if (__atomic_compare_exchange_n(&cmd->state, &state, CMD_STATE_WAITING, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        state = CMD_STATE_WAITING;
+    }
+    const int32_t shared = handle->flags & CMDQUEUE_SHM;
+    while (!cmd_finished(state)) {
+        if (deadline_ns == CMD_NO_DEADLINE) {
+            if (shared) {
+                futex_wait_shared(&cmd->state, CMD_STATE_WAITING);
+            } else {
+                futex_wait(&cmd->state, CMD_STATE_WAITING);
+            }
+        } else if ((shared ? futex_wait_until_shared(&cmd->state, CMD_STATE_WAITING, deadline_ns)
+                           : futex_wait_until(&cmd->state, CMD_STATE_WAITING, deadline_ns)) == ETIMEDOUT &&
+                   cmdqueue_abandon_cmd(handle, cmd)) {
+            return ETIMEDOUT;
+        }
+        state = __atomic_load_n(&cmd->state, __ATOMIC_ACQUIRE);
+    }
+    if (handle->spin_max_ns) spin_learn(&handle->spin_sync_ns, now_ns() - start);
+
+    cmdqueue_release_cmd(handle, cmd);
+    return (state == CMD_STATE_CANCELLED) ? ECANCELED : 0;
+}
+
+// final is CMD_STATE_DONE or CMD_STATE_CANCELLED
+static void cmdqueue_complete_cmd(CmdQueue* handle, Cmd* cmd, uint32_t final)
+{
+    // only wake when the waiter went to sleep. A woken waiter may release the command and a shrink
+    // free its chunk before the wake lands, which then fails with EFAULT or wakes nobody
+    uint32_t state = __atomic_exchange_n(&cmd->state, final, __ATOMIC_ACQ_REL);
+    if (state == CMD_STATE_WAITING) {
+        if (handle->flags & CMDQUEUE_SHM) {
+            futex_wake_shared(&cmd->state, 1);
+        } else {
+            futex_wake(&cmd->state, 1);
+        }
+    } else if (state == CMD_STATE_GROUPED) {
+        // the last one wakes the group waiter, the word may be gone by the time the wake lands
+        uint32_t* group = cmd->group;
+        if (!__atomic_sub_fetch(group, 1, __ATOMIC_ACQ_REL)) futex_wake(group, 1);
+    } else if (state == CMD_STATE_ABANDONED) {
+        freelist_push(handle, cmd);
+    }
+}
+
+int32_t cmdqueue_sync_cmd(CmdQueue* handle, Cmd* cmd)
+{
+    cmdqueue_schedule_cmd(handle, cmd, CMDQUEUE_SYNC, CMDQUEUE_PRIO_LOW);
+    return cmdqueue_wait_cmd(handle, cmd, CMD_NO_DEADLINE);
+}
+
+int32_t cmdqueue_sync_highprio_cmd(CmdQueue* handle, Cmd* cmd)
+{
+    cmdqueue_schedule_cmd(handle, cmd, CMDQUEUE_SYNC, CMDQUEUE_PRIO_HIGH);
+    return cmdqueue_wait_cmd(handle, cmd, CMD_NO_DEADLINE);
+}
 
-typedef enum {
-    CMD_FREE = 0,
-    CMD_TODO,
-    CMD_DONE,
-} QueueType;
+int32_t cmdqueue_sync_cmd_timed(CmdQueue* handle, Cmd* cmd, uint64_t deadline_ns)
+{
+    cmdqueue_schedule_cmd(handle, cmd, CMDQUEUE_SYNC, CMDQUEUE_PRIO_LOW);
+    return cmdqueue_wait_cmd(handle, cmd, deadline_ns);
+}
 
-typedef struct {
-    struct list_tag head_prio;  // list of prio commands
-    struct list_tag head;       // list of command
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-} Queue;
+int32_t cmdqueue_sync_highprio_cmd_timed(CmdQueue* handle, Cmd* cmd, uint64_t deadline_ns)
+{
+    cmdqueue_schedule_cmd(handle, cmd, CMDQUEUE_SYNC, CMDQUEUE_PRIO_HIGH);
+    return cmdqueue_wait_cmd(handle, cmd, deadline_ns);
+}
 
-struct CmdQueue_ {
-    Queue queues[3];        // CMD_FREE, CMD_TODO, CMD_DONE
-    const char* name;       // no ownership
-    pthread_t tid;
-    int32_t stop;
-    void* cookie;
-    void (*cmd_callback)(void* cookie, Cmd*  cmd);
-    void* cmdlist;
-};
+int32_t cmdqueue_sync_prio_cmd_timed(CmdQueue* handle, Cmd* cmd, uint32_t prio, uint64_t deadline_ns)
+{
+    cmdqueue_schedule_cmd(handle, cmd, CMDQUEUE_SYNC, prio);
+    return cmdqueue_wait_cmd(handle, cmd, deadline_ns);
+}
 
-Cmd* cmdqueue_getcmd_sync(CmdQueue* handle)
+void cmdqueue_async_cmd(CmdQueue* handle, Cmd* cmd)
 {
-    Cmd* cmd = cmdqueue_getcmd_async(handle);
-    if (!cmd) {
-        Q_LOCK(CMD_FREE);
+    cmdqueue_schedule_cmd(handle, cmd, CMDQUEUE_ASYNC, CMDQUEUE_PRIO_LOW);
+}
+
+int32_t cmdqueue_async_coalesced_cmd(CmdQueue* handle, Cmd* cmd, uint64_t key)
+{
+    assert(handle->coalesce_hash);
+    Q_LOCK(CMD_TODO);
+    uint32_t* slot = coalesce_slot(handle, key);
+    if (*slot != CMD_IDX_NONE) {
+        if (handle->cmd_merge_callback) handle->cmd_merge_callback(handle->cookie, cmd_at(handle, *slot), cmd);
+        Q_UNLOCK(CMD_TODO);
+        stats_add(handle, &handle->stats.coalesced, 1);
+        freelist_push(handle, cmd);
+        return 1;
+    }
+
+    cmd->type = CMDQUEUE_ASYNC;
+    cmd->state = CMD_STATE_PENDING;
+    cmd->flags = CMD_FLAG_COALESCE;
+    cmd->prio = CMDQUEUE_PRIO_LOW;
+    cmd->key = key;
+    if (handle->timestamps) cmd->enqueue_ns = now_ns();
+    TRACE(TRACE_SCHEDULE, cmd->idx);
+    handle->coalesce_next[cmd->idx] = CMD_IDX_NONE;
+    *slot = cmd->idx;
+    lane_add(handle, cmd, 0);
+    Q_SIGNAL(CMD_TODO);
+    Q_UNLOCK(CMD_TODO);
+    return 0;
+}
+
+CmdQueueTicket cmdqueue_submit(CmdQueue* handle, Cmd* cmd)
+{
+    cmdqueue_schedule_cmd(handle, cmd, CMDQUEUE_SYNC, CMDQUEUE_PRIO_LOW);
+    CmdQueueTicket ticket = { handle, cmd };
+    return ticket;
+}
+
+int32_t cmdqueue_wait(CmdQueueTicket ticket)
+{
+    return cmdqueue_wait_cmd(ticket.queue, ticket.cmd, CMD_NO_DEADLINE);
+}
 
-        while (!list_count(&handle->queues[CMD_FREE].head)) {
-            Q_WAIT(CMD_FREE);
+uint32_t cmdqueue_wait_all(const CmdQueueTicket* tickets, uint32_t n)
+{
+    // counted up before each command joins so it cannot reach 0 while joining
+    uint32_t group = 0;
+    for (uint32_t i=0; i<n; i++) {
+        Cmd* cmd = tickets[i].cmd;
+        // the group word lives in this process
+        assert(!(tickets[i].queue->flags & CMDQUEUE_SHM));
+        __atomic_add_fetch(&group, 1, __ATOMIC_RELAXED);
+        cmd->group = &group;
+        uint32_t state = CMD_STATE_PENDING;
+        if (!__atomic_compare_exchange_n(&cmd->state, &state, CMD_STATE_GROUPED, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            // already done or cancelled
+            __atomic_sub_fetch(&group, 1, __ATOMIC_RELAXED);
         }
+    }
 
-        list_t node = handle->queues[CMD_FREE].head.next;
-        list_remove(node);
-        cmd = (Cmd*)node;
+    uint32_t left;
+    while ((left = __atomic_load_n(&group, __ATOMIC_ACQUIRE)) != 0) {
+        futex_wait(&group, left);
+    }
 
-        Q_UNLOCK(CMD_FREE);
+    uint32_t cancelled = 0;
+    for (uint32_t i=0; i<n; i++) {
+        if (__atomic_load_n(&tickets[i].cmd->state, __ATOMIC_ACQUIRE) == CMD_STATE_CANCELLED) cancelled++;
+        cmdqueue_release_cmd(tickets[i].queue, tickets[i].cmd);
     }
-    return cmd;
+    return cancelled;
 }
 
-Cmd* cmdqueue_getcmd_async(CmdQueue* handle)
+int32_t cmdqueue_sync_prio_cmd(CmdQueue* handle, Cmd* cmd, uint32_t prio)
 {
-    Cmd* cmd = NULL;
-    Q_LOCK(CMD_FREE);
+    cmdqueue_schedule_cmd(handle, cmd, CMDQUEUE_SYNC, prio);
+    return cmdqueue_wait_cmd(handle, cmd, CMD_NO_DEADLINE);
+}
 
-    if (list_count(&handle->queues[CMD_FREE].head)) {
-        list_t node = handle->queues[CMD_FREE].head.next;
-        list_remove(node);
-        cmd = (Cmd*)node;
-    }
+void cmdqueue_async_prio_cmd(CmdQueue* handle, Cmd* cmd, uint32_t prio)
+{
+    cmdqueue_schedule_cmd(handle, cmd, CMDQUEUE_ASYNC, prio);
+}
 
-    Q_UNLOCK(CMD_FREE);
-    return cmd;
+void cmdqueue_async_cmd_notify(CmdQueue* handle, Cmd* cmd)
+{
+    assert(handle->done_fd != -1);
+    cmdqueue_schedule_cmd(handle, cmd, CMDQUEUE_NOTIFY, CMDQUEUE_PRIO_LOW);
 }
 
-static void cmdqueue_schedule_cmd(CmdQueue* handle, Cmd* cmd, uint32_t sync, int32_t prio)
+void cmdqueue_async_prio_cmd_notify(CmdQueue* handle, Cmd* cmd, uint32_t prio)
 {
-    list_t list = (prio == CMDQUEUE_PRIO_LOW) ? &handle->queues[CMD_TODO].head : &handle->queues[CMD_TODO].head_prio;
-    cmd->type = sync;
-    Q_LOCK(CMD_TODO);
-    list_add_tail(list, &cmd->head);
-    Q_BROADCAST(CMD_TODO);
-    Q_UNLOCK(CMD_TODO);
+    assert(handle->done_fd != -1);
+    cmdqueue_schedule_cmd(handle, cmd, CMDQUEUE_NOTIFY, prio);
 }
 
-static int32_t cmd_finished(list_t const src, const Cmd* cmd)
+// one eventfd write per drain of the completion lane, not per command
+static void completion_signal(CmdQueue* handle)
 {
-#if 0
-    uint64_t count = 0;
-    int32_t done = 0;
-    list_t node = src->next;
+    if (__atomic_load_n(&handle->done_armed, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&handle->done_armed, 0, __ATOMIC_SEQ_CST)) {
+        eventfd_write(handle->done_fd, 1);
+    }
+}
 
-    while (node != src) {
-        count++;
-        node = node->next;
+int cmdqueue_completion_fd(CmdQueue* handle)
+{
+    return handle->done_fd;
+}
+
+int32_t cmdqueue_sched_error(CmdQueue* handle)
+{
+    return handle->sched_error;
+}
+
+uint32_t cmdqueue_reap(CmdQueue* handle, Cmd** cmds, uint32_t max)
+{
+    uint32_t count = 0;
+    while (count < max) {
+        Cmd* cmd = mpsc_pop(&handle->done);
+        if (!cmd) break;
+        cmds[count++] = cmd;
     }
+    if (count < max) {
+        // drained, re-arm and cover a completion that raced with it by signalling ourselves
+        eventfd_t value;
+        eventfd_read(handle->done_fd, &value);
+        __atomic_store_n(&handle->done_armed, 1, __ATOMIC_SEQ_CST);
+        if (!mpsc_empty(&handle->done)) completion_signal(handle);
+    }
+    return count;
+}
 
-    if (count > 0) {
-        node = src->next;
+void cmdqueue_putcmd(CmdQueue* handle, Cmd* cmd)
+{
+    magazine_put(handle, cmd);
+}
 
-        while (node != src && !done) {
-            done = (Cmd* )node == cmd;
-            node = node->next;
-        }
+void cmdqueue_async_cmd_batch(CmdQueue* handle, Cmd** cmds, uint32_t n)
+{
+    if (!n) return;
+
+    uint64_t now = handle->timestamps ? now_ns() : 0;
+    for (uint32_t i=0; i<n; i++) {
+        cmds[i]->type = CMDQUEUE_ASYNC;
+        cmds[i]->flags = 0;
+        cmds[i]->prio = CMDQUEUE_PRIO_LOW;
+        cmds[i]->enqueue_ns = now;
+        TRACE(TRACE_SCHEDULE, cmds[i]->idx);
     }
 
-    return done;
-#else
-    // BB: smaller version
-    list_t node = src->next;
-    while (node != src) {
-        if (node == &cmd->head) return 1;
-        node = node->next;
+    if (handle->flags & CMDQUEUE_SHM) {
+        shm_lane_push_batch(handle, cmds, n, MPSC_LANE(CMDQUEUE_PRIO_LOW));
+        return;
     }
-    return 0;
-#endif
+    if (handle->flags & CMDQUEUE_ATTR_LOCKFREE) {
+        stats_add(handle, &handle->stats.depth[CMDQUEUE_PRIO_LOW], n);
+        mpsc_push_batch(&handle->lanes[MPSC_LANE(CMDQUEUE_PRIO_LOW)], cmds, n);
+        lockfree_wakeup(handle);
+        return;
+    }
+
+    Q_LOCK(CMD_TODO);
+    for (uint32_t i=0; i<n; i++) {
+        lane_add(handle, cmds[i], 0);
+    }
+    if (n > 1 && handle->num_workers > 1) {
+        Q_BROADCAST(CMD_TODO);
+    } else {
+        Q_SIGNAL(CMD_TODO);
+    }
+    Q_UNLOCK(CMD_TODO);
 }
 
-static void cmdqueue_wait_cmd(CmdQueue* handle, Cmd* cmd)
+static void cmdqueue_schedule_timer(CmdQueue* handle, Cmd* cmd, uint64_t deadline_ns, uint64_t period_ns)
 {
-    Q_LOCK(CMD_DONE);
+    assert(!(handle->flags & (CMDQUEUE_ATTR_LOCKFREE | CMDQUEUE_SHM)));
+    cmd->type = CMDQUEUE_ASYNC;
+    cmd->state = CMD_STATE_PENDING;
+    cmd->flags = period_ns ? CMD_FLAG_PERIODIC : 0;
+    cmd->prio = CMDQUEUE_PRIO_LOW;
+    cmd->deadline_ns = deadline_ns;
+    cmd->period_ns = period_ns;
+    TRACE(TRACE_SCHEDULE, cmd->idx);
 
-    while (!cmd_finished(&handle->queues[CMD_DONE].head, cmd) ) {
-        Q_WAIT(CMD_DONE);
-    }
+    Q_LOCK(CMD_TODO);
+    timer_arm(handle, cmd, now_ns());
+    // the woken worker recomputes its timed wait
+    Q_SIGNAL(CMD_TODO);
+    Q_UNLOCK(CMD_TODO);
+}
 
-    list_remove(&cmd->head);
-    Q_UNLOCK(CMD_DONE);
+void cmdqueue_async_cmd_at(CmdQueue* handle, Cmd* cmd, uint64_t deadline_ns)
+{
+    cmdqueue_schedule_timer(handle, cmd, deadline_ns, 0);
+}
 
-    Q_LOCK(CMD_FREE);
-    list_add_front(&handle->queues[CMD_FREE].head, &cmd->head);
-    Q_BROADCAST(CMD_FREE);
-    Q_UNLOCK(CMD_FREE);
+void cmdqueue_async_cmd_periodic(CmdQueue* handle, Cmd* cmd, uint64_t deadline_ns, uint64_t period_ns)
+{
+    assert(period_ns);
+    cmdqueue_schedule_timer(handle, cmd, deadline_ns, period_ns);
 }
 
-void cmdqueue_sync_cmd(CmdQueue* handle, Cmd* cmd)
+int32_t cmdqueue_cancel_timer(CmdQueue* handle, Cmd* cmd)
 {
-    cmdqueue_schedule_cmd(handle, cmd, CMDQUEUE_SYNC, CMDQUEUE_PRIO_LOW);
-    cmdqueue_wait_cmd(handle, cmd);
+    int32_t cancelled = 1;
+    int32_t release = 0;
+
+    Q_LOCK(CMD_TODO);
+    if (cmd->flags & CMD_FLAG_TIMER) {
+        timerwheel_remove(&handle->wheel, &cmd->head);
+        cmd->flags &= ~CMD_FLAG_TIMER;
+        release = 1;
+    } else if (cmd->flags & CMD_FLAG_QUEUED) {
+        lane_remove(handle, cmd);
+        release = 1;
+    } else if (cmd->flags & CMD_FLAG_PERIODIC) {
+        // running, the worker releases it afterwards
+        cmd->flags |= CMD_FLAG_CANCELLED;
+    } else {
+        cancelled = 0;
+    }
+    Q_UNLOCK(CMD_TODO);
+
+    if (release) freelist_push(handle, cmd);
+    return cancelled;
 }
 
-void cmdqueue_sync_highprio_cmd(CmdQueue* handle, Cmd* cmd)
+int32_t cmdqueue_sync_keyed_cmd(CmdQueue* handle, Cmd* cmd, uint64_t key)
 {
-    cmdqueue_schedule_cmd(handle, cmd, CMDQUEUE_SYNC, CMDQUEUE_PRIO_HIGH);
-    cmdqueue_wait_cmd(handle, cmd);
+    cmdqueue_schedule_keyed_cmd(handle, cmd, CMDQUEUE_SYNC, key);
+    return cmdqueue_wait_cmd(handle, cmd, CMD_NO_DEADLINE);
 }
 
-void cmdqueue_async_cmd(CmdQueue* handle, Cmd* cmd)
+void cmdqueue_async_keyed_cmd(CmdQueue* handle, Cmd* cmd, uint64_t key)
 {
-    cmdqueue_schedule_cmd(handle, cmd, CMDQUEUE_ASYNC, CMDQUEUE_PRIO_LOW);
+    cmdqueue_schedule_keyed_cmd(handle, cmd, CMDQUEUE_ASYNC, key);
 }
 
-static void* thread_func(void* arg)
+// takes up to max commands, prio lane first, returns 0 on stop
+static uint32_t todo_next_cmds(CmdQueue* handle, Cmd** cmds, uint32_t max)
 {
-    CmdQueue* handle= (CmdQueue*)arg;
-    Cmd dummy_cmd;
+    uint32_t count = 0;
+    uint64_t idle_start = 0;
 
-    while (1) {
-        Cmd* cmd = &dummy_cmd;
+    Q_LOCK(CMD_TODO);
 
-        Q_LOCK(CMD_TODO);
+    while (!handle->stop) {
+        uint64_t now = (handle->timestamps || handle->wheel.count) ? now_ns() : 0;
+        if (handle->wheel.count) timers_expire(handle, now);
 
-        // TODO BB dont count, just check not-empty
-        //while (!list_count(&handle->queues[CMD_TODO].head) &&
-        //       !list_count(&handle->queues[CMD_TODO].head_prio) &&
-        while (list_empty(&handle->queues[CMD_TODO].head) &&
-               list_empty(&handle->queues[CMD_TODO].head_prio) &&
-               !handle->stop) {
-            Q_WAIT(CMD_TODO);
+        if (!lanes_empty(handle)) {
+            if (idle_start) spin_learn(&handle->spin_worker_ns, now_ns() - idle_start);
+            while (count < max && !lanes_empty(handle)) {
+                cmds[count++] = lanes_pop(handle, now);
+            }
+            break;
         }
 
-        if (!handle->stop) {
-            if (!list_empty(&handle->queues[CMD_TODO].head_prio)) {
-                // TODO BB to_container
-                cmd = (Cmd*)handle->queues[CMD_TODO].head_prio.next;
-                list_remove(&cmd->head);
-            } else {
-                // TODO BB to_container
-                cmd = (Cmd*)handle->queues[CMD_TODO].head.next;
-                list_remove(&cmd->head);
+        if (!idle_start && handle->spin_max_ns) {
+            // producers only signal the cond, so watch the lane bitmap outside the lock
+            idle_start = now_ns();
+            uint64_t budget = spin_budget(handle, &handle->spin_worker_ns);
+            if (budget) {
+                Q_UNLOCK(CMD_TODO);
+                for (uint32_t i=1; !__atomic_load_n(&handle->queues[CMD_TODO].word_map, __ATOMIC_RELAXED) &&
+                                   !__atomic_load_n(&handle->stop, __ATOMIC_RELAXED); i++) {
+                    cpu_relax();
+                    if (!(i & SPIN_CHECK_MASK) && now_ns() - idle_start >= budget) break;
+                }
+                Q_LOCK(CMD_TODO);
+                continue;
             }
         }
 
+        if (handle->wheel.count) {
+            todo_wait_until(handle, timerwheel_next(&handle->wheel) * handle->timer_tick_ns);
+        } else {
+            Q_WAIT(CMD_TODO);
+        }
+    }
+
+    Q_UNLOCK(CMD_TODO);
+    return count;
+}
+
+static void cmdqueue_finish_cmds(CmdQueue* handle, Cmd** cmds, uint32_t n)
+{
+    for (uint32_t i=0; i<n; i++) TRACE(TRACE_COMPLETE, cmds[i]->idx);
+
+    uint32_t locked = 0;
+    for (uint32_t i=0; i<n; i++) locked |= cmds[i]->flags & (CMD_FLAG_KEYED | CMD_FLAG_PERIODIC);
+    if (locked) {
+        uint64_t now = 0;
+        Q_LOCK(CMD_TODO);
+        for (uint32_t i=0; i<n; i++) {
+            Cmd* cmd = cmds[i];
+            if (cmd->flags & CMD_FLAG_KEYED) strand_advance(handle, cmd->key);
+            if ((cmd->flags & (CMD_FLAG_PERIODIC | CMD_FLAG_CANCELLED)) == CMD_FLAG_PERIODIC) {
+                if (!now) now = now_ns();
+                do {
+                    cmd->deadline_ns += cmd->period_ns;
+                } while (cmd->deadline_ns <= now);
+                timer_arm(handle, cmd, now);
+                cmds[i] = NULL;
+            }
+        }
+        if (locked & CMD_FLAG_PERIODIC) Q_SIGNAL(CMD_TODO);
         Q_UNLOCK(CMD_TODO);
+    }
+
+    // async commands are compacted to the front and go back to the pool in one splice
+    uint32_t num_free = 0;
+    int32_t notify = 0;
+    for (uint32_t i=0; i<n; i++) {
+        Cmd* cmd = cmds[i];
+        if (!cmd) continue;
+        if (cmd->type == CMDQUEUE_SYNC) {
+            cmdqueue_complete_cmd(handle, cmd, CMD_STATE_DONE);
+        } else if (cmd->type == CMDQUEUE_NOTIFY) {
+            mpsc_push(&handle->done, cmd);
+            notify = 1;
+        } else {
+            cmds[num_free++] = cmd;
+        }
+    }
+    freelist_push_batch(handle, cmds, num_free);
+    if (notify) completion_signal(handle);
+}
+
+static uint32_t next_cmds(CmdQueue* handle, Cmd** cmds, uint32_t max)
+{
+    if (handle->flags & CMDQUEUE_SHM) return shm_next_cmds(handle, cmds, max);
+    if (handle->flags & CMDQUEUE_ATTR_LOCKFREE) return lockfree_next_cmds(handle, cmds, max);
+    return todo_next_cmds(handle, cmds, max);
+}
 
-        if (handle->stop) break;
+static void* thread_func(void* arg)
+{
+    CmdQueue* handle= (CmdQueue*)arg;
+    Cmd** cmds = malloc(handle->batch_size * sizeof(Cmd*));
+    assert(cmds);
+    const int32_t stats = handle->flags & CMDQUEUE_ATTR_STATS;
 
-        handle->cmd_callback(handle->cookie, cmd);
+    while (1) {
+        uint32_t n = next_cmds(handle, cmds, handle->batch_size);
+        if (!n) break;
+        for (uint32_t i=0; i<n; i++) TRACE(TRACE_DEQUEUE, cmds[i]->idx);
 
-        QueueType type = (cmd->type == CMDQUEUE_SYNC) ? CMD_DONE : CMD_FREE;
+        if (handle->cmd_batch_callback) {
+            uint64_t start = stats ? now_ns() : 0;
+            for (uint32_t i=0; i<n; i++) TRACE(TRACE_CB_START, cmds[i]->idx);
+            handle->cmd_batch_callback(handle->cookie, cmds, n);
+            for (uint32_t i=0; i<n; i++) TRACE(TRACE_CB_END, cmds[i]->idx);
+            if (stats) hist_record(&handle->stats.exec, now_ns() - start);
+        } else {
+            for (uint32_t i=0; i<n; i++) {
+                uint64_t start = stats ? now_ns() : 0;
+                TRACE(TRACE_CB_START, cmds[i]->idx);
+                handle->cmd_callback(handle->cookie, cmds[i]);
+                TRACE(TRACE_CB_END, cmds[i]->idx);
+                if (stats) hist_record(&handle->stats.exec, now_ns() - start);
+            }
+        }
 
-        Q_LOCK(type);
-        list_add_tail(&handle->queues[type].head, &cmd->head);
-        Q_BROADCAST(type);
-        Q_UNLOCK(type);
+        cmdqueue_finish_cmds(handle, cmds, n);
     }
 
+    free(cmds);
     return 0;
 }
 
+void cmdqueue_attr_init(CmdQueueAttr* attr)
+{
+    attr->flags = 0;
+    attr->num_workers = 1;
+    attr->batch_size = 1;
+    attr->cmd_batch_callback = NULL;
+    attr->cmd_merge_callback = NULL;
+    attr->aging_ratio = 0;
+    attr->aging_max_wait_ns = 0;
+    attr->timer_tick_ns = 1000000;
+    attr->trace_events = 4096;
+    attr->spin_max_ns = 20000;
+    attr->grow_commands = 0;
+    attr->max_commands = 0;
+    for (uint32_t k=0; k<CMDQUEUE_SIZE_CLASSES; k++) attr->size_classes[k] = 0;
+    attr->cpuset = NULL;
+    attr->cpuset_size = 0;
+    attr->sched_policy = -1;
+    attr->sched_priority = 0;
+    attr->stack_size = 0;
+    attr->sigmask = NULL;
+    attr->magazine_size = 0;
+}
+
 CmdQueue* cmdqueue_create(const char* name,
                           void (*cmd_callback)(void* cookie, Cmd* cmd),
                           void* cookie,
                           uint32_t num_commands,
                           uint32_t size_cmd)
 {
-    CmdQueue* handle = calloc(1, sizeof(CmdQueue));
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    return cmdqueue_create_attr(name, cmd_callback, cookie, num_commands, size_cmd, &attr);
+}
+
+CmdQueue* cmdqueue_create_pool(const char* name,
+                               void (*cmd_callback)(void* cookie, Cmd* cmd),
+                               void* cookie,
+                               uint32_t num_commands,
+                               uint32_t size_cmd,
+                               uint32_t num_workers)
+{
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.num_workers = num_workers;
+    return cmdqueue_create_attr(name, cmd_callback, cookie, num_commands, size_cmd, &attr);
+}
+
+// everything but the command pool and the workers
+static CmdQueue* handle_alloc(const char* name,
+                              void (*cmd_callback)(void* cookie, Cmd* cmd),
+                              void* cookie,
+                              const CmdQueueAttr* attr)
+{
+    CmdQueue* handle = NULL;
+    PTHREAD_CHK(posix_memalign((void**)&handle, CACHE_LINE, sizeof(CmdQueue)));
     assert(handle);
+    memset(handle, 0, sizeof(CmdQueue));
 
+    // timed waits for the timer wheel are against CLOCK_MONOTONIC
+    pthread_condattr_t condattr;
+    PTHREAD_CHK(pthread_condattr_init(&condattr));
+    PTHREAD_CHK(pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC));
     for (uint32_t i=0; i<ARRAY_SIZE(handle->queues); i++) {
-        list_init(&handle->queues[i].head_prio);
-        list_init(&handle->queues[i].head);
+        for (uint32_t p=0; p<CMDQUEUE_PRIO_LEVELS; p++) {
+            list_init(&handle->queues[i].lanes[p]);
+        }
         PTHREAD_CHK(pthread_mutex_init(&handle->queues[i].mutex, 0));
-        PTHREAD_CHK(pthread_cond_init(&handle->queues[i].cond, 0));
+        PTHREAD_CHK(pthread_cond_init(&handle->queues[i].cond, &condattr));
+    }
+    PTHREAD_CHK(pthread_condattr_destroy(&condattr));
+    for (uint32_t i=0; i<ARRAY_SIZE(handle->lanes); i++) {
+        mpsc_init(&handle->lanes[i]);
+    }
+    mpsc_init(&handle->done);
+    handle->done_fd = -1;
+    if (attr->flags & CMDQUEUE_ATTR_COMPLETION) {
+        handle->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        assert(handle->done_fd != -1);
+        handle->done_armed = 1;
     }
 
+    handle->flags = attr->flags;
+
     handle->name = name;
     handle->stop = 0;
     handle->cookie = cookie;
     handle->cmd_callback = cmd_callback;
-    handle->cmdlist = malloc(num_commands*size_cmd);
+    handle->cmd_batch_callback = attr->cmd_batch_callback;
+    handle->batch_size = attr->batch_size;
+    handle->aging_ratio = attr->aging_ratio;
+    handle->aging_max_wait_ns = attr->aging_max_wait_ns;
+    handle->timestamps = (attr->flags & CMDQUEUE_ATTR_STATS) || attr->aging_max_wait_ns;
+    handle->timer_tick_ns = attr->timer_tick_ns;
+    // spinning only pays off when the thread it waits for runs on another cpu
+    cpu_set_t cpus;
+    if ((attr->flags & CMDQUEUE_ATTR_SPIN) ||
+        (sched_getaffinity(0, sizeof(cpus), &cpus) == 0 && CPU_COUNT(&cpus) > 1)) {
+        handle->spin_max_ns = attr->spin_max_ns;
+    }
+    if (attr->flags & CMDQUEUE_ATTR_TRACE) trace_init(&handle->trace, attr->trace_events);
+    timerwheel_init(&handle->wheel, now_ns() / handle->timer_tick_ns, cmd_timer_expires, handle);
+    PTHREAD_CHK(pthread_mutex_init(&handle->pool_mutex, 0));
+    return handle;
+}
+
+// workers inherit the signal mask of the creating thread, so it is swapped around pthread_create
+static void workers_start(CmdQueue* handle, const CmdQueueAttr* attr)
+{
+    pthread_attr_t thread_attr;
+    PTHREAD_CHK(pthread_attr_init(&thread_attr));
+    if (attr->cpuset) {
+        PTHREAD_CHK(pthread_attr_setaffinity_np(&thread_attr, attr->cpuset_size, (const cpu_set_t*)attr->cpuset));
+    }
+    if (attr->stack_size) PTHREAD_CHK(pthread_attr_setstacksize(&thread_attr, attr->stack_size));
+
+    sigset_t blocked;
+    sigset_t saved;
+    if (attr->sigmask) {
+        blocked = *attr->sigmask;
+    } else {
+        // faults stay deliverable, so a crash in a callback reaches the application's handler
+        sigfillset(&blocked);
+        sigdelset(&blocked, SIGSEGV);
+        sigdelset(&blocked, SIGBUS);
+        sigdelset(&blocked, SIGFPE);
+        sigdelset(&blocked, SIGILL);
+        sigdelset(&blocked, SIGTRAP);
+        sigdelset(&blocked, SIGSYS);
+    }
+    PTHREAD_CHK(pthread_sigmask(SIG_SETMASK, &blocked, &saved));
+
+    for (uint32_t i=0; i<handle->num_workers; i++) {
+        PTHREAD_CHK(pthread_create(&handle->tids[i], &thread_attr, thread_func, handle));
+
+        // set on the thread, the attr route only takes SCHED_OTHER/FIFO/RR. Realtime policies need
+        // CAP_SYS_NICE or RLIMIT_RTPRIO, the worker keeps the inherited one without
+        if (attr->sched_policy != -1) {
+            struct sched_param param = { .sched_priority = attr->sched_priority };
+            int err = pthread_setschedparam(handle->tids[i], attr->sched_policy, &param);
+            if (err && !handle->sched_error) handle->sched_error = err;
+        }
 
-    // NOTE: could use index instead of pointers, just add to circular buffer? (no linked lists)
-    uint8_t* iter = (uint8_t*)handle->cmdlist;
+        // visible in top/perf, at most 15 characters with the worker number of a pool kept
+        if (handle->name) {
+            char thread_name[16];
+            if (handle->num_workers > 1) {
+                char suffix[12];
+                int len = snprintf(suffix, sizeof(suffix), "/%u", i);
+                snprintf(thread_name, sizeof(thread_name), "%.*s%s", 15 - len, handle->name, suffix);
+            } else {
+                snprintf(thread_name, sizeof(thread_name), "%s", handle->name);
+            }
+            pthread_setname_np(handle->tids[i], thread_name);
+        }
+    }
+
+    PTHREAD_CHK(pthread_sigmask(SIG_SETMASK, &saved, NULL));
+    PTHREAD_CHK(pthread_attr_destroy(&thread_attr));
+}
+
+CmdQueue* cmdqueue_create_attr(const char* name,
+                               void (*cmd_callback)(void* cookie, Cmd* cmd),
+                               void* cookie,
+                               uint32_t num_commands,
+                               uint32_t size_cmd,
+                               const CmdQueueAttr* attr)
+{
+    // the lock-free lanes have a single consumer
+    assert(attr->num_workers >= 1);
+    assert(attr->batch_size >= 1);
+    assert(attr->timer_tick_ns >= 1);
+    assert(cmd_callback || attr->cmd_batch_callback);
+    assert(!(attr->flags & CMDQUEUE_ATTR_LOCKFREE) || (!attr->aging_ratio && !attr->aging_max_wait_ns));
+    assert(attr->num_workers == 1 || !(attr->flags & CMDQUEUE_ATTR_LOCKFREE));
+
+    CmdQueue* handle = handle_alloc(name, cmd_callback, cookie, attr);
+    // size classes, every one gets its own range of slot indices
+    uint32_t grow = attr->grow_commands;
+    assert(!grow || attr->max_commands >= num_commands);
+    uint32_t total = 0;
+    handle->num_classes = 0;
+    for (uint32_t k=0; k<=CMDQUEUE_SIZE_CLASSES; k++) {
+        uint32_t size = k ? attr->size_classes[k-1] : size_cmd;
+        if (k && !size) break;
+        assert(size >= sizeof(Cmd) && (!k || size > (k > 1 ? attr->size_classes[k-2] : size_cmd)));
+        SizeClass* cls = &handle->classes[handle->num_classes++];
+        uint32_t initial = k ? 0 : num_commands;
+        if (attr->flags & CMDQUEUE_ATTR_ALIGN) size = (size + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+        cls->size = size;
+        cls->base = total;
+        cls->chunk_cmds = grow ? grow : (num_commands ? num_commands : 1);
+        cls->min_chunks = grow ? (initial + grow - 1) / grow : !!num_commands;
+        cls->num_chunks = grow ? (attr->max_commands + grow - 1) / grow : cls->min_chunks;
+        cls->free_top = CMD_IDX_NONE;
+        size_t page = (attr->flags & CMDQUEUE_ATTR_HUGEPAGES) ? HUGEPAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+        cls->chunk_bytes = ((size_t)cls->chunk_cmds * size + page - 1) & ~(page - 1);
+        cls->chunks = calloc(cls->num_chunks + 1, sizeof(void*));
+        cls->chunk_free = calloc(cls->num_chunks + 1, sizeof(uint32_t));
+        assert(cls->chunks && cls->chunk_free);
+        assert((uint64_t)total + (uint64_t)cls->num_chunks * cls->chunk_cmds < CMD_IDX_NONE);
+        total += cls->num_chunks * cls->chunk_cmds;
+    }
+    handle->slots = malloc(((size_t)total + 1) * sizeof(Cmd*));
+    handle->free_next = malloc(((size_t)total + 1) * sizeof(uint32_t));
+    assert(handle->slots && handle->free_next);
+    for (uint32_t k=0; k<handle->num_classes; k++) {
+        SizeClass* cls = &handle->classes[k];
+        for (uint32_t c=0; c<cls->min_chunks; c++) chunk_alloc(handle, cls, c);
+        stats_add(handle, &handle->stats.pool_bytes, (int64_t)cls->min_chunks * cls->chunk_cmds * cls->size);
+    }
+    handle->magazine_size = attr->magazine_size;
+    if (handle->magazine_size) PTHREAD_CHK(pthread_key_create(&handle->magazine_key, magazine_exit));
+
+    // keyed and coalesced commands are bounded by every slot that may ever exist
+    num_commands = total;
+
+    handle->cmd_merge_callback = attr->cmd_merge_callback;
+    if (!(attr->flags & CMDQUEUE_ATTR_LOCKFREE) && num_commands) {
+        uint32_t buckets = 1;
+        while (buckets < num_commands) buckets <<= 1;
+        handle->coalesce_hash = malloc(buckets * sizeof(uint32_t));
+        handle->coalesce_next = malloc(num_commands * sizeof(uint32_t));
+        assert(handle->coalesce_hash && handle->coalesce_next);
+        for (uint32_t i=0; i<buckets; i++) handle->coalesce_hash[i] = CMD_IDX_NONE;
+        handle->coalesce_mask = buckets - 1;
+    }
+
+    if (attr->num_workers > 1 && num_commands) {
+        uint32_t buckets = 1;
+        while (buckets < num_commands) buckets <<= 1;
+        handle->strands = calloc(num_commands, sizeof(Strand));
+        handle->strand_hash = calloc(buckets, sizeof(Strand*));
+        assert(handle->strands && handle->strand_hash);
+        handle->strand_mask = buckets - 1;
+        list_init(&handle->strand_active);
+        for (uint32_t i=0; i<num_commands; i++) {
+            handle->strands[i].next = handle->strand_free;
+            handle->strand_free = &handle->strands[i];
+        }
+    }
+
+    handle->num_workers = attr->num_workers;
+    handle->tids = calloc(handle->num_workers, sizeof(pthread_t));
+    assert(handle->tids);
+    workers_start(handle, attr);
+    return handle;
+}
+
+CmdQueue* cmdqueue_create_shm(const char* path,
+                              void (*cmd_callback)(void* cookie, Cmd* cmd),
+                              void* cookie,
+                              uint32_t num_commands,
+                              uint32_t size_cmd,
+                              const CmdQueueAttr* attr)
+{
+    // one consumer for the lane stacks, and nothing that needs pointers between processes
+    assert(attr->num_workers == 1);
+    assert(attr->batch_size >= 1);
+    assert(cmd_callback || attr->cmd_batch_callback);
+    assert(!(attr->flags & (CMDQUEUE_ATTR_LOCKFREE | CMDQUEUE_ATTR_COMPLETION)));
+    assert(!attr->grow_commands && !attr->size_classes[0] && !attr->magazine_size);
+    assert(!attr->aging_ratio && !attr->aging_max_wait_ns);
+    assert(size_cmd >= sizeof(Cmd));
+
+    size_t slab_offset = (sizeof(ShmRegion) + (size_t)num_commands * sizeof(uint32_t) + CACHE_LINE - 1) &
+                         ~(size_t)(CACHE_LINE - 1);
+    size_t size = slab_offset + (size_t)num_commands * size_cmd;
+    // never reuse a file, a live queue may still have it mapped
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1) return NULL;
+    ShmRegion* shm = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0) shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        unlink(path);
+        return NULL;
+    }
+
+    // the file starts zeroed
+    shm->version = SHM_VERSION;
+    shm->header_size = sizeof(ShmRegion);
+    shm->num_commands = num_commands;
+    shm->size_cmd = size_cmd;
+    shm->slab_offset = (uint32_t)slab_offset;
+    shm->timestamps = (attr->flags & CMDQUEUE_ATTR_STATS) != 0;
+    shm->lanes[0] = CMD_IDX_NONE;
+    shm->lanes[1] = CMD_IDX_NONE;
+    uint8_t* slab = (uint8_t*)shm + slab_offset;
     for (uint32_t i=0; i<num_commands; i++) {
-        Cmd* cmd = (Cmd*)iter;
-        list_add_tail(&handle->queues[CMD_FREE].head, &cmd->head);
-        iter += size_cmd;
+        ((Cmd*)(slab + (size_t)i * size_cmd))->idx = i;
+        shm->next[i] = (i + 1 < num_commands) ? i + 1 : CMD_IDX_NONE;
+    }
+    shm->free_top = num_commands ? 0 : CMD_IDX_NONE;
+    __atomic_store_n(&shm->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+    char* owned = strdup(path);
+    assert(owned);
+    CmdQueue* handle = handle_alloc(owned, cmd_callback, cookie, attr);
+    handle->flags |= CMDQUEUE_SHM;
+    handle->shm = shm;
+    handle->shm_slab = slab;
+    handle->shm_commands = num_commands;
+    handle->shm_size_cmd = size_cmd;
+    handle->shm_size = size;
+    handle->shm_path = owned;
+    handle->shm_owner = 1;
+    handle->shm_pending[0] = CMD_IDX_NONE;
+    handle->shm_pending[1] = CMD_IDX_NONE;
+
+    handle->num_workers = 1;
+    handle->tids = calloc(1, sizeof(pthread_t));
+    assert(handle->tids);
+    workers_start(handle, attr);
+    return handle;
+}
+
+CmdQueue* cmdqueue_attach_shm(const char* path)
+{
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    struct stat st;
+    ShmRegion* shm = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ShmRegion)) {
+        shm = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (shm == MAP_FAILED) {
+        errno = EAGAIN;
+        return NULL;
+    }
+    // not (yet) initialized by cmdqueue_create_shm
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+        munmap(shm, (size_t)st.st_size);
+        errno = EAGAIN;
+        return NULL;
+    }
+    // another version or build layout, or sizes the file does not hold
+    uint32_t num_commands = shm->num_commands;
+    uint32_t size_cmd = shm->size_cmd;
+    uint64_t slab_offset = shm->slab_offset;
+    if (shm->version != SHM_VERSION || shm->header_size != sizeof(ShmRegion) ||
+        size_cmd < sizeof(Cmd) || num_commands >= CMD_IDX_NONE ||
+        slab_offset < sizeof(ShmRegion) + (uint64_t)num_commands * sizeof(uint32_t) ||
+        slab_offset + (uint64_t)num_commands * size_cmd > (uint64_t)st.st_size) {
+        munmap(shm, (size_t)st.st_size);
+        errno = EINVAL;
+        return NULL;
     }
 
-    PTHREAD_CHK(pthread_create(&handle->tid, 0, thread_func, handle));
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    char* owned = strdup(path);
+    assert(owned);
+    CmdQueue* handle = handle_alloc(owned, NULL, NULL, &attr);
+    handle->flags |= CMDQUEUE_SHM;
+    handle->shm = shm;
+    handle->shm_slab = (uint8_t*)shm + slab_offset;
+    handle->timestamps = shm->timestamps != 0;
+    handle->shm_commands = num_commands;
+    handle->shm_size_cmd = size_cmd;
+    handle->shm_size = (size_t)st.st_size;
+    handle->shm_path = owned;
     return handle;
 }
 
 void cmdqueue_destroy(CmdQueue* handle)
 {
-    Q_LOCK(CMD_TODO);
-    handle->stop = 1;
-    Q_BROADCAST(CMD_TODO);
-    Q_UNLOCK(CMD_TODO);
+    if (handle->flags & CMDQUEUE_SHM) {
+        // attached handles have no worker and leave the creator's alone
+        if (handle->shm_owner) {
+            __atomic_store_n(&handle->stop, 1, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&handle->shm->parked, 0, __ATOMIC_SEQ_CST);
+            futex_wake_shared(&handle->shm->parked, INT32_MAX);
+        }
+    } else if (handle->flags & CMDQUEUE_ATTR_LOCKFREE) {
+        __atomic_store_n(&handle->stop, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&handle->parked, 0, __ATOMIC_SEQ_CST);
+        futex_wake(&handle->parked, 1);
+    } else {
+        Q_LOCK(CMD_TODO);
+        handle->stop = 1;
+        Q_BROADCAST(CMD_TODO);
+        Q_UNLOCK(CMD_TODO);
+    }
 
-    PTHREAD_CHK(pthread_join(handle->tid, 0));
+    for (uint32_t i=0; i<handle->num_workers; i++) {
+        PTHREAD_CHK(pthread_join(handle->tids[i], 0));
+    }
+    free(handle->tids);
 
     for (uint32_t i=0; i<ARRAY_SIZE(handle->queues); i++) {
         PTHREAD_CHK(pthread_mutex_destroy(&handle->queues[i].mutex));
         PTHREAD_CHK(pthread_cond_destroy(&handle->queues[i].cond));
     }
 
-    free(handle->cmdlist);
+    if (handle->flags & CMDQUEUE_ATTR_TRACE) trace_destroy(&handle->trace);
+    if (handle->done_fd != -1) close(handle->done_fd);
+    free(handle->coalesce_next);
+    free(handle->coalesce_hash);
+    free(handle->strand_hash);
+    free(handle->strands);
+    for (uint32_t k=0; k<handle->num_classes; k++) {
+        SizeClass* cls = &handle->classes[k];
+        for (uint32_t c=0; c<cls->num_chunks; c++) {
+            if (cls->chunks[c]) chunk_mem_free(handle, cls, cls->chunks[c]);
+        }
+        free(cls->chunks);
+        free(cls->chunk_free);
+    }
+    if (handle->magazine_size) {
+        PTHREAD_CHK(pthread_key_delete(handle->magazine_key));
+        Magazine* mag = handle->magazines;
+        while (mag) {
+            Magazine* next = mag->next;
+            free(mag);
+            mag = next;
+        }
+    }
+    PTHREAD_CHK(pthread_mutex_destroy(&handle->pool_mutex));
+    if (handle->shm) {
+        munmap(handle->shm, handle->shm_size);
+        if (handle->shm_owner) unlink(handle->shm_path);
+        free(handle->shm_path);
+    }
+    free(handle->free_next);
+    free(handle->slots);
     free(handle);
 }
 
-/* only for async commands on the non prio head */
-void cmdqueue_flush(CmdQueue* handle,
-                    void (*flush_callback)(void* cookie, Cmd* cmd, uint32_t* count),
-                    void* cookie,
-                    uint32_t* count)
+void cmdqueue_get_lane_stats(CmdQueue* handle, uint32_t prio, CmdQueueLaneStats* stats)
 {
-    Q_LOCK(CMD_TODO);
-    Q_LOCK(CMD_FREE);
+    assert(prio < CMDQUEUE_PRIO_LEVELS);
+    const CmdQueueLaneStats* src = &handle->queues[CMD_TODO].lane_stats[prio];
+    stats->dispatched = __atomic_load_n(&src->dispatched, __ATOMIC_RELAXED);
+    stats->aged = __atomic_load_n(&src->aged, __ATOMIC_RELAXED);
+    stats->wait_total_ns = __atomic_load_n(&src->wait_total_ns, __ATOMIC_RELAXED);
+    stats->wait_max_ns = __atomic_load_n(&src->wait_max_ns, __ATOMIC_RELAXED);
+}
+
+void cmdqueue_get_stats(CmdQueue* handle, CmdQueueStats* stats)
+{
+    // all counters, read one by one, the snapshot is not atomic as a whole
+    const uint64_t* src = (const uint64_t*)&handle->stats;
+    uint64_t* dst = (uint64_t*)stats;
+    for (size_t i=0; i<sizeof(CmdQueueStats) / sizeof(uint64_t); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+    // kept whether or not CMDQUEUE_ATTR_STATS is set
+    stats->spin_sync_ns = spin_budget(handle, &handle->spin_sync_ns);
+}
+
+int32_t cmdqueue_trace_dump(CmdQueue* handle, FILE* out)
+{
+    assert(handle->flags & CMDQUEUE_ATTR_TRACE);
+    return trace_dump(&handle->trace, out, handle->name);
+}
+
+// called with CMD_TODO locked, moves every queued, key-blocked or delayed command the predicate
+// picks to out: lanes first so a keyed command precedes its cancelled successors, then strands, timers
+static void cancel_detach(CmdQueue* handle, int32_t (*predicate)(void* cookie, const Cmd* cmd), void* cookie,
+                          list_t out)
+{
+    struct list_tag pending;
+    list_init(&pending);
+    // only the strands in use, not the whole hash
+    list_t active = &handle->strand_active;
+    for (list_t s = handle->strand_hash ? active->next : active; s != active; s = s->next) {
+        Strand* strand = to_container(Strand, active, s);
+        list_t node = strand->pending.next;
+        while (node != &strand->pending) {
+            Cmd* cmd = (Cmd*)node;
+            node = node->next;
+            if (!predicate(cookie, cmd)) continue;
+            list_remove(&cmd->head);
+            list_add_tail(&pending, &cmd->head);
+        }
+    }
+
+    Queue* q = &handle->queues[CMD_TODO];
+    for (uint32_t prio=0; prio<CMDQUEUE_PRIO_LEVELS; prio++) {
+        if (!(q->lane_map[prio / 64] & (1ull << (prio % 64)))) continue;
+        // strand_advance puts a successor at the lane front, behind this walk and already judged
+        list_t node = q->lanes[prio].next;
+        while (node != &q->lanes[prio]) {
+            Cmd* cmd = (Cmd*)node;
+            node = node->next;
+            if (!predicate(cookie, cmd)) continue;
+            lane_remove(handle, cmd);
+            list_add_tail(out, &cmd->head);
+            if (cmd->flags & CMD_FLAG_KEYED) strand_advance(handle, cmd->key);
+        }
+    }
+    list_move(&pending, out);
 
-    list_t src = &handle->queues[CMD_TODO].head;
-    list_t dest = &handle->queues[CMD_FREE].head;
+    for (uint32_t l=0; l<TIMERWHEEL_LEVELS && handle->wheel.count; l++) {
+        for (uint32_t s=0; s<TIMERWHEEL_SLOTS; s++) {
+            list_t slot = &handle->wheel.slots[l][s];
+            list_t node = slot->next;
+            while (node != slot) {
+                Cmd* cmd = (Cmd*)node;
+                node = node->next;
+                if (!predicate(cookie, cmd)) continue;
+                timerwheel_remove(&handle->wheel, &cmd->head);
+                cmd->flags &= ~CMD_FLAG_TIMER;
+                list_add_tail(out, &cmd->head);
+            }
+        }
+    }
+}
 
-    list_t node = src->next;
-    while (node != src) {
-        list_t tmp_node = node;
-        node = node->next;
-        list_remove(tmp_node);
-        // TODO BB use to_container
-        if (flush_callback) flush_callback(cookie, (Cmd*)tmp_node, count);
-        list_add_tail(dest, tmp_node);
+// outside the lock, callbacks first, then the commands end like a finished one would
+static uint32_t cancel_finish(CmdQueue* handle, list_t cancelled, void (*cancel_callback)(void* cookie, Cmd* cmd),
+                              void* cookie)
+{
+    uint32_t count = 0;
+    int32_t notify = 0;
+    while (!list_empty(cancelled)) {
+        Cmd* cmd = (Cmd*)cancelled->next;
+        list_remove(&cmd->head);
+        if (cancel_callback) cancel_callback(cookie, cmd);
+        if (cmd->type == CMDQUEUE_SYNC) {
+            cmdqueue_complete_cmd(handle, cmd, CMD_STATE_CANCELLED);
+        } else if (cmd->type == CMDQUEUE_NOTIFY) {
+            mpsc_push(&handle->done, cmd);
+            notify = 1;
+        } else {
+            freelist_push(handle, cmd);
+        }
+        count++;
     }
+    if (notify) completion_signal(handle);
+    return count;
+}
+
+uint32_t cmdqueue_cancel_if(CmdQueue* handle,
+                            int32_t (*predicate)(void* cookie, const Cmd* cmd),
+                            void (*cancel_callback)(void* cookie, Cmd* cmd),
+                            void* cookie)
+{
+    assert(!(handle->flags & (CMDQUEUE_ATTR_LOCKFREE | CMDQUEUE_SHM)));
 
-    Q_UNLOCK(CMD_FREE);
+    struct list_tag cancelled;
+    list_init(&cancelled);
+    Q_LOCK(CMD_TODO);
+    cancel_detach(handle, predicate, cookie, &cancelled);
     Q_UNLOCK(CMD_TODO);
+    return cancel_finish(handle, &cancelled, cancel_callback, cookie);
+}
+
+typedef struct {
+    void (*flush_callback)(void* cookie, Cmd* cmd, uint32_t* count);
+    void* cookie;
+    uint32_t* count;
+} FlushCtx;
+
+static int32_t flush_predicate(void* cookie, const Cmd* cmd)
+{
+    return cmd->prio == CMDQUEUE_PRIO_LOW && !(cmd->flags & CMD_FLAG_TIMER);
+}
+
+static void flush_cancelled(void* cookie, Cmd* cmd)
+{
+    FlushCtx* ctx = (FlushCtx*)cookie;
+    if (ctx->flush_callback) ctx->flush_callback(ctx->cookie, cmd, ctx->count);
+}
+
+/* everything waiting on the non prio lane, including commands blocked behind their key */
+void cmdqueue_flush(CmdQueue* handle,
+                    void (*flush_callback)(void* cookie, Cmd* cmd, uint32_t* count),
+                    void* cookie,
+                    uint32_t* count)
+{
+    FlushCtx ctx = { flush_callback, cookie, count };
+    cmdqueue_cancel_if(handle, flush_predicate, flush_cancelled, &ctx);
 }
 
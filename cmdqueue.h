@@ -2,6 +2,8 @@
 #define CMDQUEUE_H
 
 #include <stdint.h>
+#include <stdio.h>
+#include <signal.h>
 #include "pthread.h"
 
 #include "list.h"
@@ -13,33 +15,282 @@ extern "C" {
 typedef struct {
     struct list_tag head;
     uint32_t type;      // SYNC / ASYNC
+    uint32_t state;     // completion futex word for sync commands
+    uint32_t idx;       // slot index in the pool, fixed while the slot exists
+    uint32_t flags;     // internal
+    uint32_t prio;      // CMDQUEUE_PRIO_LOW .. CMDQUEUE_PRIO_HIGH
+    uint64_t key;       // ordering key for cmdqueue_*_keyed_cmd, or the coalesce key
+    uint64_t enqueue_ns;    // CLOCK_MONOTONIC, only set with CMDQUEUE_ATTR_STATS or aging
+    uint64_t deadline_ns;   // timer commands
+    uint64_t period_ns;
+    uint32_t* group;    // cmdqueue_wait_all countdown
 } Cmd;
 
 typedef struct CmdQueue_ CmdQueue;
 
+// a submitted sync command, see cmdqueue_submit
+typedef struct {
+    CmdQueue* queue;
+    Cmd* cmd;
+} CmdQueueTicket;
+
+// priority levels, higher runs first; the lock-free engine only has LOW and anything above it
+#define CMDQUEUE_PRIO_LEVELS    256
+#define CMDQUEUE_PRIO_LOW       0
+#define CMDQUEUE_PRIO_HIGH      (CMDQUEUE_PRIO_LEVELS - 1)
+
+// lock-free multi-producer lanes feeding the worker, does not support cmdqueue_flush/cancel_if
+#define CMDQUEUE_ATTR_LOCKFREE  0x1
+// keep statistics, see cmdqueue_get_stats and cmdqueue_get_lane_stats
+#define CMDQUEUE_ATTR_STATS     0x2
+// record command lifecycle events per thread, see cmdqueue_trace_dump
+#define CMDQUEUE_ATTR_TRACE     0x4
+// eventfd completion notification, see cmdqueue_async_cmd_notify
+#define CMDQUEUE_ATTR_COMPLETION    0x8
+// command slots rounded up to whole cache lines, so neighbours filled by other threads never share one
+#define CMDQUEUE_ATTR_ALIGN     0x10
+// pool chunks on hugepages, reserved ones when available, else transparent ones
+#define CMDQUEUE_ATTR_HUGEPAGES 0x20
+// pool chunks faulted in and mlocked (best effort) when allocated, so no getcmd takes a page fault
+#define CMDQUEUE_ATTR_PREFAULT  0x40
+// spin before parking even on a single cpu, see CmdQueueAttr.spin_max_ns
+#define CMDQUEUE_ATTR_SPIN      0x80
+
+// max extra slot sizes, see CmdQueueAttr.size_classes
+#define CMDQUEUE_SIZE_CLASSES   4
+
+typedef struct {
+    uint32_t flags;         // CMDQUEUE_ATTR_*
+    uint32_t num_workers;   // > 1 gives up the total order between commands, not with CMDQUEUE_ATTR_LOCKFREE
+    uint32_t batch_size;    // max commands a worker takes per dequeue, prio lane first
+    // optional, replaces cmd_callback and gets every dequeued batch at once
+    void (*cmd_batch_callback)(void* cookie, Cmd** cmds, uint32_t n);
+    // optional, folds cmd into the still queued command with the same coalesce key, runs with the
+    // queue locked so keep it short. Without it the newer command is simply dropped
+    void (*cmd_merge_callback)(void* cookie, Cmd* pending, Cmd* cmd);
+    // anti-starvation, the lanes below the highest non-empty one take turns: the next of them gets
+    // a dispatch after aging_ratio dispatches passed it by, or once its oldest command waited
+    // aging_max_wait_ns (0 = off)
+    uint32_t aging_ratio;
+    uint64_t aging_max_wait_ns;
+    uint64_t timer_tick_ns;     // timer wheel resolution, timers never fire early
+    uint32_t trace_events;      // ring size per tracing thread, power of two, oldest events drop first
+    // waiters (sync callers, getcmd_sync, idle workers) spin up to twice their recent average wait
+    // before parking, never longer than this and not at all once waits average more
+    // (0 = always park, ignored on a single cpu unless CMDQUEUE_ATTR_SPIN)
+    uint64_t spin_max_ns;
+    // growable pool when > 0: a size class that runs dry allocates grow_commands more slots, up to
+    // max_commands per class, see cmdqueue_shrink. Only the size_cmd class starts with num_commands.
+    // A fixed pool (0) allocates num_commands slots per class at create
+    uint32_t grow_commands;
+    uint32_t max_commands;
+    // extra slot sizes above size_cmd, ascending, 0 terminated, see cmdqueue_getcmd_sized
+    uint32_t size_classes[CMDQUEUE_SIZE_CLASSES];
+    // worker threads, named after the queue (name/N in a pool, cut to 15 characters)
+    const void* cpuset;         // cpu_set_t (or CPU_ALLOC'd) affinity, NULL = inherit
+    size_t cpuset_size;
+    int32_t sched_policy;       // SCHED_*, -1 = inherit. Stays inherited when not permitted, see cmdqueue_sched_error
+    int32_t sched_priority;
+    size_t stack_size;          // 0 = default
+    // blocked in the workers, leave signals to the application. NULL = all but the synchronous faults
+    // (SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGTRAP, SIGSYS), which go to the thread that raised them
+    const sigset_t* sigmask;
+    // per thread cache of free size_cmd commands (0 = off). getcmd and release take from and give to it,
+    // trading with the shared pool magazine_size/2 at a time. Commands cached by one thread are out of
+    // reach of the others until it releases while someone blocks, calls cmdqueue_magazine_flush or
+    // exits, so keep num_commands well above magazine_size times the producer threads
+    uint32_t magazine_size;
+} CmdQueueAttr;
+
+typedef struct {
+    uint64_t dispatched;
+    uint64_t aged;              // dispatches forced by the aging policy
+    uint64_t wait_total_ns;     // enqueue to dequeue
+    uint64_t wait_max_ns;
+} CmdQueueLaneStats;
+
+// log-bucketed histogram of nanoseconds, 2^CMDQUEUE_HIST_SUB_BITS buckets per power of two (< 25% error)
+#define CMDQUEUE_HIST_SUB_BITS  2
+#define CMDQUEUE_HIST_BUCKETS   (64 << CMDQUEUE_HIST_SUB_BITS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t buckets[CMDQUEUE_HIST_BUCKETS];
+} CmdQueueHist;
+
+typedef struct {
+    uint64_t depth[CMDQUEUE_PRIO_LEVELS];   // commands waiting per lane, excludes timers and blocked keys
+    uint64_t pool_empty;        // cmdqueue_getcmd_* calls that found no free command
+    uint64_t coalesced;         // commands merged into a queued one
+    uint64_t pool_bytes;        // command slots currently allocated, all size classes
+    uint64_t spin_sync_ns;      // current spin budget of sync waiters, 0 = they park right away
+    CmdQueueHist pool_wait;     // time cmdqueue_getcmd_sync blocked on an empty pool
+    CmdQueueHist wait;          // enqueue to dequeue
+    CmdQueueHist exec;          // callback run time, per batch with cmd_batch_callback
+    CmdQueueHist sync;          // sync round trip, submit to the waiter waking up
+} CmdQueueStats;
+
+void cmdqueue_attr_init(CmdQueueAttr* attr);
+
 CmdQueue* cmdqueue_create(const char* name,
                           void (*cmd_callback)(void* cookie, Cmd* cmd),
                           void* cookie,
                           uint32_t num_commands,
                           uint32_t size_cmd);
 
+CmdQueue* cmdqueue_create_attr(const char* name,
+                               void (*cmd_callback)(void* cookie, Cmd* cmd),
+                               void* cookie,
+                               uint32_t num_commands,
+                               uint32_t size_cmd,
+                               const CmdQueueAttr* attr);
+
+CmdQueue* cmdqueue_create_pool(const char* name,
+                               void (*cmd_callback)(void* cookie, Cmd* cmd),
+                               void* cookie,
+                               uint32_t num_commands,
+                               uint32_t size_cmd,
+                               uint32_t num_workers);
+
+// cross-process queue: the command pool and the low/high lanes live in a file mapped MAP_SHARED
+// (e.g. under /dev/shm), linked by slot index and synchronized with process-shared futexes.
+// The creating process runs the single worker, others submit through cmdqueue_attach_shm, with the
+// usual getcmd/sync/async/highprio/putcmd calls. Commands must hold no pointers. Not supported:
+// num_workers > 1, LOCKFREE, COMPLETION, growable pools, magazines, aging, timers, cancel_if,
+// coalescing and wait_all. Returns NULL with errno set when the file cannot be created, EEXIST when
+// path already exists
+CmdQueue* cmdqueue_create_shm(const char* path,
+                              void (*cmd_callback)(void* cookie, Cmd* cmd),
+                              void* cookie,
+                              uint32_t num_commands,
+                              uint32_t size_cmd,
+                              const CmdQueueAttr* attr);
+
+// NULL with errno set when path cannot be mapped, EAGAIN while the creator did not finish it, EINVAL
+// for a queue of another version or build layout (-DCMDQUEUE_PACKED) or a truncated file
+CmdQueue* cmdqueue_attach_shm(const char* path);
+
+// the creator's destroy stops the worker and removes the file, attached handles only unmap
 void cmdqueue_destroy(CmdQueue* handle);
 
+// per priority level, zeroes unless created with CMDQUEUE_ATTR_STATS
+void cmdqueue_get_lane_stats(CmdQueue* handle, uint32_t prio, CmdQueueLaneStats* stats);
+
+// snapshot, zeroes unless created with CMDQUEUE_ATTR_STATS
+void cmdqueue_get_stats(CmdQueue* handle, CmdQueueStats* stats);
+
+// writes the traced events as Chrome trace / Perfetto JSON, returns 0 or -1 on a write error
+int32_t cmdqueue_trace_dump(CmdQueue* handle, FILE* out);
+
+// upper bound of the bucket holding the given percentile (0..100), 0 when empty
+uint64_t cmdqueue_hist_percentile(const CmdQueueHist* hist, double percentile);
+
+// drops every queued command at CMDQUEUE_PRIO_LOW (see cmdqueue_cancel_if), callbacks run unlocked
 void cmdqueue_flush(CmdQueue* handle,
                     void (*flush_callback)(void* cookie, Cmd* cmd, uint32_t* count),
                     void* cookie,
                     uint32_t* count);
 
+// cancels every command the predicate picks that did not start yet, in any lane, blocked behind
+// its key or waiting for its timer. The predicate runs with the queue locked, cancel_callback
+// (optional) runs unlocked afterwards. Sync waiters return ECANCELED, notify commands still go to
+// cmdqueue_reap, the rest go back to the pool. Returns the number cancelled
+uint32_t cmdqueue_cancel_if(CmdQueue* handle,
+                            int32_t (*predicate)(void* cookie, const Cmd* cmd),
+                            void (*cancel_callback)(void* cookie, Cmd* cmd),
+                            void* cookie);
+
 Cmd* cmdqueue_getcmd_sync(CmdQueue* handle);
 
 Cmd* cmdqueue_getcmd_async(CmdQueue* handle);
 
-void cmdqueue_sync_cmd(CmdQueue* handle, Cmd* cmd);
+// deadline_ns is CLOCK_MONOTONIC, returns NULL once it passed with the pool still empty
+Cmd* cmdqueue_getcmd_timed(CmdQueue* handle, uint64_t deadline_ns);
+
+// the smallest size class holding bytes (from sizeof(Cmd) on), blocks like cmdqueue_getcmd_sync.
+// NULL when bytes exceeds every class
+Cmd* cmdqueue_getcmd_sized(CmdQueue* handle, uint32_t bytes);
 
-void cmdqueue_sync_highprio_cmd(CmdQueue* handle, Cmd* cmd);
+// frees the growable pool chunks whose commands are all free, down to what create allocated.
+// Returns how many. Concurrent cmdqueue_getcmd_* calls wait for it or, at the cap, may come back empty
+uint32_t cmdqueue_shrink(CmdQueue* handle);
+
+// returns the commands this thread's magazine holds to the shared pool, e.g. before it goes idle
+void cmdqueue_magazine_flush(CmdQueue* handle);
+
+// takes up to n free commands in one go, returns how many, never blocks
+uint32_t cmdqueue_getcmd_batch(CmdQueue* handle, Cmd** cmds, uint32_t n);
+
+// sync calls return 0 once the command ran, or ECANCELED, see cmdqueue_cancel_if
+int32_t cmdqueue_sync_cmd(CmdQueue* handle, Cmd* cmd);
+
+int32_t cmdqueue_sync_highprio_cmd(CmdQueue* handle, Cmd* cmd);
 
 void cmdqueue_async_cmd(CmdQueue* handle, Cmd* cmd);
 
+// async, merges with a queued command submitted with the same key instead of queueing again.
+// Returns 1 when merged (cmd went back to the pool), not with CMDQUEUE_ATTR_LOCKFREE
+int32_t cmdqueue_async_coalesced_cmd(CmdQueue* handle, Cmd* cmd, uint64_t key);
+
+// the submit half of cmdqueue_sync_cmd, every ticket must be waited for exactly once
+CmdQueueTicket cmdqueue_submit(CmdQueue* handle, Cmd* cmd);
+
+int32_t cmdqueue_wait(CmdQueueTicket ticket);
+
+// returns when all commands ran or were cancelled (how many were), the caller sleeps at most once
+// for the whole set. Tickets may come from different queues
+uint32_t cmdqueue_wait_all(const CmdQueueTicket* tickets, uint32_t n);
+
+int32_t cmdqueue_sync_prio_cmd(CmdQueue* handle, Cmd* cmd, uint32_t prio);
+
+void cmdqueue_async_prio_cmd(CmdQueue* handle, Cmd* cmd, uint32_t prio);
+
+// return 0 when the command ran, ECANCELED, or ETIMEDOUT at deadline_ns (CLOCK_MONOTONIC). Either way the
+// command is no longer the caller's: on a timeout it is dropped when still queued (except with
+// CMDQUEUE_ATTR_LOCKFREE), otherwise it goes back to the pool once its callback returns
+int32_t cmdqueue_sync_cmd_timed(CmdQueue* handle, Cmd* cmd, uint64_t deadline_ns);
+
+int32_t cmdqueue_sync_highprio_cmd_timed(CmdQueue* handle, Cmd* cmd, uint64_t deadline_ns);
+
+int32_t cmdqueue_sync_prio_cmd_timed(CmdQueue* handle, Cmd* cmd, uint32_t prio, uint64_t deadline_ns);
+
+// async, but the finished command is handed back through cmdqueue_reap instead of the pool.
+// Needs CMDQUEUE_ATTR_COMPLETION
+void cmdqueue_async_cmd_notify(CmdQueue* handle, Cmd* cmd);
+
+void cmdqueue_async_prio_cmd_notify(CmdQueue* handle, Cmd* cmd, uint32_t prio);
+
+// eventfd that becomes readable when finished notify commands are waiting, for poll/epoll
+int cmdqueue_completion_fd(CmdQueue* handle);
+
+// 0 when attr.sched_policy was applied to every worker, else the pthread_setschedparam error
+// (e.g. EPERM for a realtime policy without CAP_SYS_NICE), the workers then keep the inherited one
+int32_t cmdqueue_sched_error(CmdQueue* handle);
+
+// takes up to max finished notify commands, never blocks, one reaping thread at a time.
+// The fd stays readable until a call returns less than max (edge triggered users loop until then)
+uint32_t cmdqueue_reap(CmdQueue* handle, Cmd** cmds, uint32_t max);
+
+// returns a command to the pool, for reaped ones or ones taken but never submitted
+void cmdqueue_putcmd(CmdQueue* handle, Cmd* cmd);
+
+// same as n cmdqueue_async_cmd calls, with a single lock/exchange and wakeup
+void cmdqueue_async_cmd_batch(CmdQueue* handle, Cmd** cmds, uint32_t n);
+
+// commands with the same key run one at a time in submission order, other keys spread over the workers
+int32_t cmdqueue_sync_keyed_cmd(CmdQueue* handle, Cmd* cmd, uint64_t key);
+
+void cmdqueue_async_keyed_cmd(CmdQueue* handle, Cmd* cmd, uint64_t key);
+
+// deadline_ns is CLOCK_MONOTONIC, timers are not supported with CMDQUEUE_ATTR_LOCKFREE
+void cmdqueue_async_cmd_at(CmdQueue* handle, Cmd* cmd, uint64_t deadline_ns);
+
+// runs at deadline_ns and every period_ns after that until cancelled, missed periods are skipped
+void cmdqueue_async_cmd_periodic(CmdQueue* handle, Cmd* cmd, uint64_t deadline_ns, uint64_t period_ns);
+
+// returns 1 when the command will not run (again) and goes back to the pool, 0 when it already started
+int32_t cmdqueue_cancel_timer(CmdQueue* handle, Cmd* cmd);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,252 @@
+#ifndef CMDQUEUE_HPP
+#define CMDQUEUE_HPP
+
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "cmdqueue.h"
+#include "futex.h"
+
+// typed C++ front end, header only. Queue<TCmd> runs TCmd objects through Handler (TCmd::operator()
+// by default) and lambdas posted with post/call. Both are constructed in place in the pool slot, so
+// there is no heap allocation per command, and dispatch is a plain function pointer stored in the
+// slot and instantiated per payload type, no virtual call.
+//
+//   struct Start { int* started; void operator()() { *started = 1; } };
+//   cmdqueue::Queue<Start> queue("worker", 8);
+//   queue.async(queue.getcmd(Start{&started}));
+//   queue.call([&] { value = compute(); });
+//
+// Payloads are destroyed on the worker right after they ran, before a sync caller wakes up, so
+// results travel through pointers or references the payload holds. Handler and lambdas must not throw,
+// an exception out of them terminates. Not for cmdqueue_create_shm, and no cmdqueue_flush/cancel_if
+// through native(): cancelled payloads are never destroyed
+
+namespace cmdqueue {
+
+// default Handler, the commands are callables themselves
+struct Call {
+    template <typename T>
+    void operator()(T& cmd) const { cmd(); }
+};
+
+template <typename TCmd, typename Handler = Call,
+          std::size_t InlineBytes = (sizeof(TCmd) > 64 ? sizeof(TCmd) : 64)>
+class Queue {
+    struct Slot {
+        Cmd cmd;
+        void (*run)(Queue* queue, Slot* slot);  // runs and destroys the payload
+        alignas(std::max_align_t) unsigned char storage[InlineBytes];
+    };
+
+    static_assert(std::is_standard_layout<Slot>::value, "Cmd must stay the first member of a slot");
+    static_assert(sizeof(TCmd) <= InlineBytes, "TCmd does not fit the slot");
+    static_assert(alignof(TCmd) <= alignof(std::max_align_t), "TCmd is over aligned");
+
+public:
+    // a pool slot holding a constructed TCmd until async or sync take it. Move only, destroys the
+    // TCmd and puts the slot back when dropped unsubmitted
+    class Command {
+    public:
+        Command() noexcept : queue_(nullptr), slot_(nullptr) {}
+        Command(Command&& other) noexcept : queue_(other.queue_), slot_(other.slot_) { other.slot_ = nullptr; }
+        Command& operator=(Command&& other) noexcept {
+            if (this != &other) {
+                reset();
+                queue_ = other.queue_;
+                slot_ = other.slot_;
+                other.slot_ = nullptr;
+            }
+            return *this;
+        }
+        Command(const Command&) = delete;
+        Command& operator=(const Command&) = delete;
+        ~Command() { reset(); }
+
+        TCmd* get() const noexcept { return slot_ ? payload<TCmd>(slot_) : nullptr; }
+        TCmd* operator->() const noexcept { assert(slot_); return get(); }
+        TCmd& operator*() const noexcept { assert(slot_); return *get(); }
+        explicit operator bool() const noexcept { return slot_ != nullptr; }
+
+        void reset() noexcept {
+            if (!slot_) return;
+            get()->~TCmd();
+            cmdqueue_putcmd(queue_->handle_, &slot_->cmd);
+            slot_ = nullptr;
+        }
+
+    private:
+        friend class Queue;
+        Command(Queue* queue, Slot* slot) noexcept : queue_(queue), slot_(slot) {}
+
+        Slot* release() noexcept {
+            assert(slot_);
+            Slot* slot = slot_;
+            slot_ = nullptr;
+            return slot;
+        }
+
+        Queue* queue_;
+        Slot* slot_;
+    };
+
+    // attr as for cmdqueue_create_attr, minus cmd_batch_callback and the shm queue
+    Queue(const char* name, uint32_t num_commands, Handler handler = Handler(), const CmdQueueAttr* attr = nullptr)
+        : submitted_(0), draining_(0), handler_(std::move(handler))
+    {
+        CmdQueueAttr defaults;
+        if (!attr) {
+            cmdqueue_attr_init(&defaults);
+            attr = &defaults;
+        }
+        assert(!attr->cmd_batch_callback);
+        handle_ = cmdqueue_create_attr(name, callback, this, num_commands, sizeof(Slot), attr);
+    }
+
+    // the worker holds on to this, so no copy and no move
+    Queue(const Queue&) = delete;
+    Queue& operator=(const Queue&) = delete;
+
+    // cmdqueue_destroy drops what is still queued, so first wait until every submitted payload ran
+    // and was destroyed, whichever worker has it
+    ~Queue()
+    {
+        __atomic_store_n(&draining_, 1, __ATOMIC_SEQ_CST);
+        uint32_t n;
+        while ((n = __atomic_load_n(&submitted_, __ATOMIC_SEQ_CST)) != 0) futex_wait(&submitted_, n);
+        cmdqueue_destroy(handle_);
+    }
+
+    // blocks while the pool is empty
+    template <typename... Args>
+    Command getcmd(Args&&... args)
+    {
+        return construct(to_slot(cmdqueue_getcmd_sync(handle_)), std::forward<Args>(args)...);
+    }
+
+    // empty Command when the pool is empty
+    template <typename... Args>
+    Command try_getcmd(Args&&... args)
+    {
+        Cmd* cmd = cmdqueue_getcmd_async(handle_);
+        if (!cmd) return Command();
+        return construct(to_slot(cmd), std::forward<Args>(args)...);
+    }
+
+    void async(Command cmd, uint32_t prio = CMDQUEUE_PRIO_LOW)
+    {
+        cmdqueue_async_prio_cmd(handle_, submit(cmd.release()), prio);
+    }
+
+    // returns once the worker ran and destroyed the command, result as cmdqueue_sync_prio_cmd
+    int32_t sync(Command cmd, uint32_t prio = CMDQUEUE_PRIO_LOW)
+    {
+        return cmdqueue_sync_prio_cmd(handle_, submit(cmd.release()), prio);
+    }
+
+    // fn runs on the worker, its captures are stored in the slot and must fit InlineBytes
+    template <typename F>
+    void post(F&& fn, uint32_t prio = CMDQUEUE_PRIO_LOW)
+    {
+        cmdqueue_async_prio_cmd(handle_, submit(emplace_fn(std::forward<F>(fn))), prio);
+    }
+
+    // as post and waits for fn, so it may capture the caller's locals by reference
+    template <typename F>
+    int32_t call(F&& fn, uint32_t prio = CMDQUEUE_PRIO_LOW)
+    {
+        return cmdqueue_sync_prio_cmd(handle_, submit(emplace_fn(std::forward<F>(fn))), prio);
+    }
+
+    // for the rest of the C API: stats, tracing, shrink
+    CmdQueue* native() const noexcept { return handle_; }
+
+private:
+    template <typename T>
+    static T* payload(Slot* slot) noexcept { return reinterpret_cast<T*>(slot->storage); }
+
+    static Slot* to_slot(Cmd* cmd) noexcept { return reinterpret_cast<Slot*>(cmd); }
+
+    Cmd* submit(Slot* slot) noexcept
+    {
+        __atomic_add_fetch(&submitted_, 1, __ATOMIC_RELAXED);
+        return &slot->cmd;
+    }
+
+    // the destructor waits for the last one, it only sleeps once draining
+    void finished() noexcept
+    {
+        if (__atomic_sub_fetch(&submitted_, 1, __ATOMIC_SEQ_CST) == 0 &&
+            __atomic_load_n(&draining_, __ATOMIC_SEQ_CST)) {
+            futex_wake(&submitted_, INT32_MAX);
+        }
+    }
+
+    // noexcept: an exception must not unwind through the C worker
+    static void callback(void* cookie, Cmd* cmd) noexcept
+    {
+        Slot* slot = to_slot(cmd);
+        slot->run(static_cast<Queue*>(cookie), slot);
+    }
+
+    static void run_cmd(Queue* queue, Slot* slot) noexcept
+    {
+        TCmd* cmd = payload<TCmd>(slot);
+        queue->handler_(*cmd);
+        cmd->~TCmd();
+        queue->finished();
+    }
+
+    template <typename F>
+    static void run_fn(Queue* queue, Slot* slot) noexcept
+    {
+        F* fn = payload<F>(slot);
+        (*fn)();
+        fn->~F();
+        queue->finished();
+    }
+
+    // puts the slot back if the constructor throws
+    struct SlotGuard {
+        CmdQueue* handle;
+        Slot* slot;
+        ~SlotGuard() { if (slot) cmdqueue_putcmd(handle, &slot->cmd); }
+    };
+
+    template <typename... Args>
+    Command construct(Slot* slot, Args&&... args)
+    {
+        SlotGuard guard = { handle_, slot };
+        ::new (static_cast<void*>(slot->storage)) TCmd(std::forward<Args>(args)...);
+        guard.slot = nullptr;
+        slot->run = run_cmd;
+        return Command(this, slot);
+    }
+
+    template <typename F>
+    Slot* emplace_fn(F&& fn)
+    {
+        typedef typename std::decay<F>::type Fn;
+        static_assert(sizeof(Fn) <= InlineBytes, "lambda captures do not fit the slot");
+        static_assert(alignof(Fn) <= alignof(std::max_align_t), "lambda captures are over aligned");
+
+        Slot* slot = to_slot(cmdqueue_getcmd_sync(handle_));
+        SlotGuard guard = { handle_, slot };
+        ::new (static_cast<void*>(slot->storage)) Fn(std::forward<F>(fn));
+        guard.slot = nullptr;
+        slot->run = run_fn<Fn>;
+        return slot;
+    }
+
+    CmdQueue* handle_;
+    uint32_t submitted_;    // futex word, payloads submitted and not yet destroyed
+    uint32_t draining_;
+    Handler handler_;
+};
+
+} // namespace cmdqueue
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// thin wrappers around the futex syscall, process private unless _shared (words in MAP_SHARED memory)
+
+static inline void futex_wait(uint32_t* addr, uint32_t val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline int32_t futex_wait_until_op(uint32_t* addr, uint32_t val, uint64_t deadline_ns, int op)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline_ns / 1000000000ull;
+    ts.tv_nsec = deadline_ns % 1000000000ull;
+    if (syscall(SYS_futex, addr, op, val, &ts, NULL, FUTEX_BITSET_MATCH_ANY) == -1 && errno == ETIMEDOUT) {
+        return ETIMEDOUT;
+    }
+    return 0;
+}
+
+// absolute CLOCK_MONOTONIC deadline, returns ETIMEDOUT once it passed, 0 on any other return
+static inline int32_t futex_wait_until(uint32_t* addr, uint32_t val, uint64_t deadline_ns)
+{
+    return futex_wait_until_op(addr, val, deadline_ns, FUTEX_WAIT_BITSET_PRIVATE);
+}
+
+static inline void futex_wake(uint32_t* addr, int32_t count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static inline void futex_wait_shared(uint32_t* addr, uint32_t val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static inline int32_t futex_wait_until_shared(uint32_t* addr, uint32_t val, uint64_t deadline_ns)
+{
+    return futex_wait_until_op(addr, val, deadline_ns, FUTEX_WAIT_BITSET);
+}
+
+static inline void futex_wake_shared(uint32_t* addr, int32_t count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+#endif
+
@@ -0,0 +1,39 @@
+#include <stdint.h>
+
+#include "hist.h"
+
+#define SUB_BITS    CMDQUEUE_HIST_SUB_BITS
+#define SUB_COUNT   (1u << SUB_BITS)
+
+// exact below SUB_COUNT, then SUB_COUNT linear buckets per power of two
+static uint32_t hist_bucket(uint64_t value) {
+    if (value < SUB_COUNT) return (uint32_t)value;
+    uint32_t msb = 63 - __builtin_clzll(value);
+    return ((msb - SUB_BITS + 1) << SUB_BITS) + (uint32_t)((value >> (msb - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+static uint64_t hist_bucket_max(uint32_t bucket) {
+    if (bucket < SUB_COUNT) return bucket;
+    uint32_t msb = (bucket >> SUB_BITS) + SUB_BITS - 1;
+    uint64_t low = (1ull << msb) | ((uint64_t)(bucket & (SUB_COUNT - 1)) << (msb - SUB_BITS));
+    return low + (1ull << (msb - SUB_BITS)) - 1;
+}
+
+void hist_record(CmdQueueHist* hist, uint64_t value) {
+    __atomic_add_fetch(&hist->buckets[hist_bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+}
+
+uint64_t cmdqueue_hist_percentile(const CmdQueueHist* hist, double percentile) {
+    if (!hist->count) return 0;
+
+    uint64_t rank = (uint64_t)((double)hist->count * percentile / 100.0);
+    if (rank >= hist->count) rank = hist->count - 1;
+    uint64_t seen = 0;
+    for (uint32_t i=0; i<CMDQUEUE_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > rank) return hist_bucket_max(i);
+    }
+    return hist_bucket_max(CMDQUEUE_HIST_BUCKETS - 1);
+}
+
@@ -0,0 +1,20 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+
+#include "cmdqueue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// relaxed atomics, safe from any thread and cheap enough to leave on
+void hist_record(CmdQueueHist* hist, uint64_t value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
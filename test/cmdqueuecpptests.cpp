@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+
+extern "C" {
+#include "ctest.h"
+}
+#include "cmdqueue.hpp"
+
+namespace {
+
+struct Counted {
+    static std::atomic<int> live;
+    uint32_t id;
+    uint32_t* order;
+    uint32_t* num_run;
+
+    Counted(uint32_t id_, uint32_t* order_, uint32_t* num_run_) : id(id_), order(order_), num_run(num_run_) { live++; }
+    Counted(Counted&& other) : id(other.id), order(other.order), num_run(other.num_run) { live++; }
+    ~Counted() { live--; }
+    void operator()() { order[(*num_run)++] = id; }
+};
+
+std::atomic<int> Counted::live(0);
+
+enum { CPP_START, CPP_STOP };
+
+// a switch dispatcher like mycmd_callback, with state of its own
+struct Dispatcher {
+    uint32_t* started;
+    uint32_t* stopped;
+    void operator()(uint32_t& type) const {
+        switch (type) {
+        case CPP_START: (*started)++; break;
+        case CPP_STOP: (*stopped)++; break;
+        }
+    }
+};
+
+}
+
+CTEST(cmdqueue_cpp, typed) {
+    uint32_t order[16];
+    uint32_t num_run = 0;
+    {
+        cmdqueue::Queue<Counted> queue("cpp", 4);
+        for (uint32_t i=0; i<8; i++) {
+            cmdqueue::Queue<Counted>::Command cmd = queue.getcmd(i, order, &num_run);
+            ASSERT_EQUAL(i, cmd->id);
+            if (i == 7) {
+                ASSERT_EQUAL(0, queue.sync(std::move(cmd)));
+            } else {
+                queue.async(std::move(cmd));
+            }
+            ASSERT_NULL(cmd.get());
+        }
+        ASSERT_EQUAL(8, num_run);
+        ASSERT_EQUAL(0, Counted::live.load());
+    }
+    for (uint32_t i=0; i<8; i++) ASSERT_EQUAL(i, order[i]);
+}
+
+CTEST(cmdqueue_cpp, move_only) {
+    uint32_t order[4];
+    uint32_t num_run = 0;
+    cmdqueue::Queue<Counted> queue("cpp", 1);
+
+    cmdqueue::Queue<Counted>::Command cmd = queue.getcmd(1, order, &num_run);
+    ASSERT_NULL(queue.try_getcmd(2, order, &num_run).get());
+    ASSERT_EQUAL(1, Counted::live.load());
+
+    cmdqueue::Queue<Counted>::Command moved(std::move(cmd));
+    ASSERT_NULL(cmd.get());
+    ASSERT_EQUAL(1, moved->id);
+
+    // dropped unsubmitted: destroyed and back in the pool
+    moved.reset();
+    ASSERT_EQUAL(0, Counted::live.load());
+    cmd = queue.try_getcmd(3, order, &num_run);
+    ASSERT_NOT_NULL(cmd.get());
+    cmd = cmdqueue::Queue<Counted>::Command();
+    ASSERT_EQUAL(0, Counted::live.load());
+
+    queue.sync(queue.getcmd(4, order, &num_run));
+    ASSERT_EQUAL(1, num_run);
+    ASSERT_EQUAL(4, order[0]);
+}
+
+CTEST(cmdqueue_cpp, handler) {
+    uint32_t started = 0;
+    uint32_t stopped = 0;
+    Dispatcher dispatcher = { &started, &stopped };
+    cmdqueue::Queue<uint32_t, Dispatcher> queue("cpp", 2, dispatcher);
+
+    queue.async(queue.getcmd(CPP_START));
+    queue.async(queue.getcmd(CPP_START));
+    queue.sync(queue.getcmd(CPP_STOP), CMDQUEUE_PRIO_LOW);
+    ASSERT_EQUAL(2, started);
+    ASSERT_EQUAL(1, stopped);
+}
+
+CTEST(cmdqueue_cpp, lambdas) {
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags = CMDQUEUE_ATTR_LOCKFREE;
+    cmdqueue::Queue<Counted> queue("cpp", 4, cmdqueue::Call(), &attr);
+
+    // captures by value live in the slot and are destroyed once the lambda ran
+    std::shared_ptr<uint32_t> shared = std::make_shared<uint32_t>(0);
+    char text[32];
+    strcpy(text, "inline");
+    uint32_t sum = 0;
+    for (uint32_t i=0; i<20; i++) {
+        queue.post([shared, i, &sum] { sum += i; (*shared)++; });
+    }
+    char copy[32];
+    int32_t result = queue.call([text, &copy] { strcpy(copy, text); });
+    ASSERT_EQUAL(0, result);
+    ASSERT_STR("inline", copy);
+    ASSERT_EQUAL(190, sum);
+    ASSERT_EQUAL(20, *shared);
+    ASSERT_EQUAL(1, shared.use_count());
+    ASSERT_NOT_NULL(queue.native());
+}
+
+CTEST(cmdqueue_cpp, destroy_drains) {
+    std::shared_ptr<uint32_t> shared = std::make_shared<uint32_t>(0);
+    {
+        cmdqueue::Queue<Counted> queue("cpp", 8);
+        for (uint32_t i=0; i<8; i++) queue.post([shared] { (*shared)++; });
+    }
+    ASSERT_EQUAL(8, *shared);
+    ASSERT_EQUAL(1, shared.use_count());
+}
+
+CTEST(cmdqueue_cpp, destroy_drains_pool) {
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.num_workers = 3;
+    std::shared_ptr<std::atomic<uint32_t> > shared = std::make_shared<std::atomic<uint32_t> >(0);
+    {
+        cmdqueue::Queue<Counted> queue("cpp", 16, cmdqueue::Call(), &attr);
+        for (uint32_t i=0; i<30; i++) queue.post([shared] { usleep(500); (*shared)++; });
+    }
+    ASSERT_EQUAL(30, shared->load());
+    ASSERT_EQUAL(1, shared.use_count());
+}
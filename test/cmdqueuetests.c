@@ -0,0 +1,1029 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "ctest.h"
+#include "cmdqueue.h"
+#include "util.h"
+
+typedef struct {
+    Cmd cmd;
+    uint32_t id;
+    uint32_t sleep_us;
+} TestCmd;
+
+static uint32_t order[64];
+static uint32_t num_run;
+static volatile uint32_t num_started;
+
+static void test_callback(void* cookie, Cmd* c)
+{
+    TestCmd* cmd = to_container(TestCmd, cmd, c);
+    num_started++;
+    if (cmd->sleep_us) usleep(cmd->sleep_us);
+    order[num_run++] = cmd->id;
+}
+
+static TestCmd* test_getcmd(CmdQueue* queue, uint32_t id, uint32_t sleep_us)
+{
+    TestCmd* cmd = (TestCmd*)cmdqueue_getcmd_sync(queue);
+    cmd->id = id;
+    cmd->sleep_us = sleep_us;
+    return cmd;
+}
+
+static void check_prio_order(CmdQueue* queue)
+{
+    num_run = 0;
+    num_started = 0;
+    cmdqueue_async_cmd(queue, &test_getcmd(queue, 1, 20000)->cmd);
+    while (!num_started) usleep(100);
+    cmdqueue_async_cmd(queue, &test_getcmd(queue, 2, 0)->cmd);
+    cmdqueue_async_cmd(queue, &test_getcmd(queue, 3, 0)->cmd);
+    cmdqueue_sync_highprio_cmd(queue, &test_getcmd(queue, 4, 0)->cmd);
+    cmdqueue_sync_cmd(queue, &test_getcmd(queue, 5, 0)->cmd);
+
+    ASSERT_EQUAL(5, num_run);
+    ASSERT_EQUAL(1, order[0]);
+    ASSERT_EQUAL(4, order[1]);
+    ASSERT_EQUAL(2, order[2]);
+    ASSERT_EQUAL(3, order[3]);
+    ASSERT_EQUAL(5, order[4]);
+}
+
+CTEST(cmdqueue, prio_order) {
+    CmdQueue* queue = cmdqueue_create("test", test_callback, NULL, 8, sizeof(TestCmd));
+    check_prio_order(queue);
+    cmdqueue_destroy(queue);
+}
+
+CTEST(cmdqueue, lockfree_prio_order) {
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags |= CMDQUEUE_ATTR_LOCKFREE;
+
+    CmdQueue* queue = cmdqueue_create_attr("test", test_callback, NULL, 8, sizeof(TestCmd), &attr);
+    check_prio_order(queue);
+    cmdqueue_destroy(queue);
+}
+
+CTEST(cmdqueue, lockfree_many_sync) {
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags |= CMDQUEUE_ATTR_LOCKFREE;
+
+    CmdQueue* queue = cmdqueue_create_attr("test", test_callback, NULL, 2, sizeof(TestCmd), &attr);
+    for (uint32_t i=0; i<1000; i++) {
+        num_run = 0;
+        cmdqueue_sync_cmd(queue, &test_getcmd(queue, i, 0)->cmd);
+        ASSERT_EQUAL(1, num_run);
+    }
+    cmdqueue_destroy(queue);
+}
+
+CTEST(cmdqueue, pool_exhaustion) {
+    CmdQueue* queue = cmdqueue_create("test", test_callback, NULL, 2, sizeof(TestCmd));
+    num_run = 0;
+
+    TestCmd* cmd1 = (TestCmd*)cmdqueue_getcmd_async(queue);
+    TestCmd* cmd2 = (TestCmd*)cmdqueue_getcmd_async(queue);
+    ASSERT_NOT_NULL(cmd1);
+    ASSERT_NOT_NULL(cmd2);
+    ASSERT_NULL(cmdqueue_getcmd_async(queue));
+
+    cmd1->id = 1;
+    cmd1->sleep_us = 10000;
+    cmdqueue_async_cmd(queue, &cmd1->cmd);
+
+    // blocks until cmd1 is returned to the pool
+    TestCmd* cmd3 = (TestCmd*)cmdqueue_getcmd_sync(queue);
+    ASSERT_TRUE(cmd3 == cmd1);
+    ASSERT_EQUAL(1, num_run);
+
+    cmd2->id = 2;
+    cmd2->sleep_us = 0;
+    cmdqueue_sync_cmd(queue, &cmd2->cmd);
+    cmd3->id = 3;
+    cmd3->sleep_us = 0;
+    cmdqueue_sync_cmd(queue, &cmd3->cmd);
+    ASSERT_EQUAL(3, num_run);
+
+    cmdqueue_destroy(queue);
+}
+
+static uint32_t stress_count;
+
+static void stress_callback(void* cookie, Cmd* c)
+{
+    __atomic_add_fetch(&stress_count, 1, __ATOMIC_RELAXED);
+}
+
+static void* stress_producer(void* arg)
+{
+    CmdQueue* queue = (CmdQueue*)arg;
+    for (uint32_t i=0; i<5000; i++) {
+        Cmd* cmd = cmdqueue_getcmd_sync(queue);
+        if (i & 1) cmdqueue_sync_cmd(queue, cmd);
+        else cmdqueue_async_cmd(queue, cmd);
+    }
+    return 0;
+}
+
+CTEST(cmdqueue, timed) {
+    CmdQueue* queue = cmdqueue_create("test", test_callback, NULL, 3, sizeof(TestCmd));
+    num_run = 0;
+    num_started = 0;
+
+    // queued behind a slow command, times out and never runs
+    cmdqueue_async_cmd(queue, &test_getcmd(queue, 1, 20000)->cmd);
+    while (!num_started) usleep(100);
+    ASSERT_EQUAL(ETIMEDOUT, cmdqueue_sync_cmd_timed(queue, &test_getcmd(queue, 2, 0)->cmd, now_ns() + 2000000));
+
+    // times out while running, the worker releases it
+    cmdqueue_sync_cmd(queue, &test_getcmd(queue, 3, 0)->cmd);
+    ASSERT_EQUAL(ETIMEDOUT, cmdqueue_sync_highprio_cmd_timed(queue, &test_getcmd(queue, 4, 20000)->cmd,
+                                                             now_ns() + 2000000));
+    ASSERT_EQUAL(0, cmdqueue_sync_cmd_timed(queue, &test_getcmd(queue, 5, 0)->cmd, now_ns() + 1000000000));
+    ASSERT_EQUAL(4, num_run);
+    ASSERT_EQUAL(1, order[0]);
+    ASSERT_EQUAL(3, order[1]);
+    ASSERT_EQUAL(4, order[2]);
+    ASSERT_EQUAL(5, order[3]);
+
+    // every command is back in the pool
+    Cmd* cmds[3];
+    for (uint32_t i=0; i<3; i++) ASSERT_NOT_NULL(cmds[i] = cmdqueue_getcmd_timed(queue, now_ns() + 1000000000));
+    uint64_t start = now_ns();
+    ASSERT_NULL(cmdqueue_getcmd_timed(queue, start + 2000000));
+    ASSERT_TRUE(now_ns() - start >= 2000000);
+    for (uint32_t i=0; i<3; i++) cmdqueue_async_cmd(queue, cmds[i]);
+    cmdqueue_destroy(queue);
+}
+
+CTEST(cmdqueue, completion_reap) {
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags |= CMDQUEUE_ATTR_COMPLETION;
+
+    CmdQueue* queue = cmdqueue_create_attr("test", stress_callback, NULL, 8, sizeof(TestCmd), &attr);
+    stress_count = 0;
+    struct pollfd pfd = { .fd = cmdqueue_completion_fd(queue), .events = POLLIN };
+
+    // an event loop keeping the whole pool in flight without ever blocking on a command
+    uint32_t submitted = 0;
+    uint32_t reaped = 0;
+    while (reaped < 200) {
+        Cmd* cmd;
+        while (submitted < 200 && (cmd = cmdqueue_getcmd_async(queue)) != NULL) {
+            ((TestCmd*)cmd)->id = submitted++;
+            cmdqueue_async_cmd_notify(queue, cmd);
+        }
+        ASSERT_EQUAL(1, poll(&pfd, 1, 1000));
+
+        Cmd* done[3];
+        uint32_t n;
+        while ((n = cmdqueue_reap(queue, done, ARRAY_SIZE(done))) != 0) {
+            for (uint32_t i=0; i<n; i++) cmdqueue_putcmd(queue, done[i]);
+            reaped += n;
+        }
+    }
+    ASSERT_EQUAL(200, stress_count);
+    ASSERT_EQUAL(0, poll(&pfd, 1, 0));
+    cmdqueue_destroy(queue);
+}
+
+CTEST(cmdqueue, tickets) {
+    CmdQueue* queue1 = cmdqueue_create("test", stress_callback, NULL, 8, sizeof(TestCmd));
+    CmdQueue* queue2 = cmdqueue_create_pool("test", stress_callback, NULL, 8, sizeof(TestCmd), 2);
+    stress_count = 0;
+
+    CmdQueueTicket ticket = cmdqueue_submit(queue1, cmdqueue_getcmd_sync(queue1));
+    cmdqueue_wait(ticket);
+    ASSERT_EQUAL(1, stress_count);
+
+    // fan out over both queues, wait once per round
+    CmdQueueTicket tickets[16];
+    for (uint32_t round=0; round<500; round++) {
+        for (uint32_t i=0; i<16; i++) {
+            CmdQueue* queue = (i & 1) ? queue2 : queue1;
+            tickets[i] = cmdqueue_submit(queue, cmdqueue_getcmd_sync(queue));
+        }
+        cmdqueue_wait_all(tickets, 16);
+        ASSERT_EQUAL(1 + (round + 1) * 16, __atomic_load_n(&stress_count, __ATOMIC_RELAXED));
+    }
+    cmdqueue_destroy(queue2);
+    cmdqueue_destroy(queue1);
+}
+
+CTEST(cmdqueue, pool_stress) {
+    CmdQueue* queue = cmdqueue_create("test", stress_callback, NULL, 3, sizeof(TestCmd));
+    pthread_t tids[4];
+    stress_count = 0;
+
+    for (uint32_t i=0; i<4; i++) pthread_create(&tids[i], 0, stress_producer, queue);
+    for (uint32_t i=0; i<4; i++) pthread_join(tids[i], 0);
+    cmdqueue_sync_cmd(queue, cmdqueue_getcmd_sync(queue));
+
+    ASSERT_EQUAL(4 * 5000 + 1, stress_count);
+    cmdqueue_destroy(queue);
+}
+
+// sync waiters spin longer while wakeups come within the window and stop once they come later
+CTEST(cmdqueue, spin_adapt) {
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags |= CMDQUEUE_ATTR_SPIN;
+    attr.spin_max_ns = 1000000;
+
+    CmdQueue* queue = cmdqueue_create_attr("test", test_callback, NULL, 4, sizeof(TestCmd), &attr);
+    CmdQueueStats stats;
+    cmdqueue_get_stats(queue, &stats);
+    ASSERT_EQUAL(1000, stats.spin_sync_ns);
+
+    // on a single cpu a spinning waiter can hold up the worker, so look for growth at any point
+    uint64_t max_budget = 0;
+    num_run = 0;
+    for (uint32_t i=0; i<50; i++) {
+        cmdqueue_sync_cmd(queue, &test_getcmd(queue, i, 0)->cmd);
+        cmdqueue_get_stats(queue, &stats);
+        ASSERT_TRUE(stats.spin_sync_ns <= attr.spin_max_ns);
+        if (stats.spin_sync_ns > max_budget) max_budget = stats.spin_sync_ns;
+    }
+    ASSERT_TRUE(max_budget > 1000);
+
+    // 20ms per command, the average goes past spin_max_ns
+    num_run = 0;
+    for (uint32_t i=0; i<5; i++) cmdqueue_sync_cmd(queue, &test_getcmd(queue, i, 20000)->cmd);
+    cmdqueue_get_stats(queue, &stats);
+    ASSERT_EQUAL(0, stats.spin_sync_ns);
+    cmdqueue_destroy(queue);
+}
+
+CTEST(cmdqueue, pool_workers) {
+    CmdQueue* queue = cmdqueue_create_pool("test", stress_callback, NULL, 16, sizeof(TestCmd), 4);
+    stress_count = 0;
+
+    for (uint32_t i=0; i<1000; i++) {
+        cmdqueue_sync_cmd(queue, cmdqueue_getcmd_sync(queue));
+    }
+    ASSERT_EQUAL(1000, stress_count);
+    cmdqueue_destroy(queue);
+}
+
+typedef struct {
+    Cmd cmd;
+    uint32_t key;
+    uint32_t seq;
+} KeyedCmd;
+
+static uint32_t key_last[4];
+static uint32_t key_running[4];
+static uint32_t key_errors;
+
+static void keyed_callback(void* cookie, Cmd* c)
+{
+    KeyedCmd* cmd = to_container(KeyedCmd, cmd, c);
+    if (c->key != cmd->key) key_errors++;
+    if (__atomic_exchange_n(&key_running[cmd->key], 1, __ATOMIC_ACQ_REL)) key_errors++;
+    if (cmd->seq != key_last[cmd->key] + 1) key_errors++;
+    key_last[cmd->key] = cmd->seq;
+    usleep(50);
+    __atomic_store_n(&key_running[cmd->key], 0, __ATOMIC_RELEASE);
+}
+
+static void check_keyed_order(CmdQueue* queue)
+{
+    memset(key_last, 0, sizeof(key_last));
+    key_errors = 0;
+
+    for (uint32_t i=1; i<=200; i++) {
+        for (uint32_t k=0; k<4; k++) {
+            KeyedCmd* cmd = (KeyedCmd*)cmdqueue_getcmd_sync(queue);
+            cmd->key = k;
+            cmd->seq = i;
+            cmdqueue_async_keyed_cmd(queue, &cmd->cmd, k);
+        }
+    }
+    for (uint32_t k=0; k<4; k++) {
+        KeyedCmd* cmd = (KeyedCmd*)cmdqueue_getcmd_sync(queue);
+        cmd->key = k;
+        cmd->seq = 201;
+        cmdqueue_sync_keyed_cmd(queue, &cmd->cmd, k);
+        ASSERT_EQUAL(201, key_last[k]);
+    }
+    ASSERT_EQUAL(0, key_errors);
+    cmdqueue_destroy(queue);
+}
+
+CTEST(cmdqueue, keyed_order) {
+    check_keyed_order(cmdqueue_create_pool("test", keyed_callback, NULL, 32, sizeof(KeyedCmd), 4));
+}
+
+// no strands with one worker, the callback still sees the key
+CTEST(cmdqueue, keyed_order_single) {
+    check_keyed_order(cmdqueue_create("test", keyed_callback, NULL, 32, sizeof(KeyedCmd)));
+}
+
+static void check_batch(CmdQueue* queue)
+{
+    Cmd* cmds[8];
+    num_run = 0;
+
+    ASSERT_EQUAL(8, cmdqueue_getcmd_batch(queue, cmds, 8));
+    ASSERT_EQUAL(0, cmdqueue_getcmd_batch(queue, cmds, 8));
+    for (uint32_t i=0; i<8; i++) {
+        TestCmd* cmd = (TestCmd*)cmds[i];
+        cmd->id = i;
+        cmd->sleep_us = 0;
+    }
+    cmdqueue_async_cmd_batch(queue, cmds, 8);
+    cmdqueue_sync_cmd(queue, &test_getcmd(queue, 8, 0)->cmd);
+
+    ASSERT_EQUAL(9, num_run);
+    for (uint32_t i=0; i<9; i++) ASSERT_EQUAL(i, order[i]);
+}
+
+CTEST(cmdqueue, batch) {
+    CmdQueue* queue = cmdqueue_create("test", test_callback, NULL, 8, sizeof(TestCmd));
+    check_batch(queue);
+    cmdqueue_destroy(queue);
+}
+
+CTEST(cmdqueue, lockfree_batch) {
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags |= CMDQUEUE_ATTR_LOCKFREE;
+
+    CmdQueue* queue = cmdqueue_create_attr("test", test_callback, NULL, 8, sizeof(TestCmd), &attr);
+    check_batch(queue);
+    cmdqueue_destroy(queue);
+}
+
+static uint32_t batch_max;
+static uint32_t batch_total;
+
+static void batch_callback(void* cookie, Cmd** cmds, uint32_t n)
+{
+    for (uint32_t i=0; i<n; i++) test_callback(cookie, cmds[i]);
+    if (n > batch_max) batch_max = n;
+    batch_total += n;
+}
+
+CTEST(cmdqueue, batch_callback) {
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.batch_size = 8;
+    attr.cmd_batch_callback = batch_callback;
+
+    CmdQueue* queue = cmdqueue_create_attr("test", NULL, NULL, 16, sizeof(TestCmd), &attr);
+    num_run = 0;
+    num_started = 0;
+    batch_max = 0;
+    batch_total = 0;
+
+    cmdqueue_async_cmd(queue, &test_getcmd(queue, 0, 20000)->cmd);
+    while (!num_started) usleep(100);
+
+    Cmd* cmds[8];
+    ASSERT_EQUAL(8, cmdqueue_getcmd_batch(queue, cmds, 8));
+    for (uint32_t i=0; i<8; i++) {
+        ((TestCmd*)cmds[i])->id = i + 1;
+        ((TestCmd*)cmds[i])->sleep_us = 0;
+    }
+    cmdqueue_async_cmd_batch(queue, cmds, 8);
+    cmdqueue_sync_cmd(queue, &test_getcmd(queue, 9, 0)->cmd);
+
+    ASSERT_EQUAL(10, batch_total);
+    ASSERT_EQUAL(8, batch_max);
+    for (uint32_t i=0; i<10; i++) ASSERT_EQUAL(i, order[i]);
+    cmdqueue_destroy(queue);
+}
+
+CTEST(cmdqueue, prio_levels) {
+    static const uint32_t prios[] = { 5, 200, 5, 17, CMDQUEUE_PRIO_HIGH, CMDQUEUE_PRIO_LOW, 64, 63 };
+    static const uint32_t expected[] = { 0, 5, 2, 7, 8, 4, 1, 3, 6, 9 };
+
+    CmdQueue* queue = cmdqueue_create("test", test_callback, NULL, 16, sizeof(TestCmd));
+    num_run = 0;
+    num_started = 0;
+
+    cmdqueue_async_cmd(queue, &test_getcmd(queue, 0, 20000)->cmd);
+    while (!num_started) usleep(100);
+    for (uint32_t i=0; i<ARRAY_SIZE(prios); i++) {
+        cmdqueue_async_prio_cmd(queue, &test_getcmd(queue, i + 1, 0)->cmd, prios[i]);
+    }
+    cmdqueue_sync_prio_cmd(queue, &test_getcmd(queue, 9, 0)->cmd, CMDQUEUE_PRIO_LOW);
+
+    ASSERT_EQUAL(10, num_run);
+    for (uint32_t i=0; i<10; i++) ASSERT_EQUAL(expected[i], order[i]);
+    cmdqueue_destroy(queue);
+}
+
+CTEST(cmdqueue, aging_ratio) {
+    static const uint32_t expected[] = { 0, 3, 4, 1, 5, 6, 2, 7, 8, 9 };
+
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags |= CMDQUEUE_ATTR_STATS;
+    attr.aging_ratio = 2;
+
+    CmdQueue* queue = cmdqueue_create_attr("test", test_callback, NULL, 16, sizeof(TestCmd), &attr);
+    num_run = 0;
+    num_started = 0;
+
+    cmdqueue_async_cmd(queue, &test_getcmd(queue, 0, 20000)->cmd);
+    while (!num_started) usleep(100);
+    cmdqueue_async_cmd(queue, &test_getcmd(queue, 1, 0)->cmd);
+    cmdqueue_async_cmd(queue, &test_getcmd(queue, 2, 0)->cmd);
+    for (uint32_t i=3; i<9; i++) {
+        cmdqueue_async_prio_cmd(queue, &test_getcmd(queue, i, 0)->cmd, CMDQUEUE_PRIO_HIGH);
+    }
+    cmdqueue_sync_cmd(queue, &test_getcmd(queue, 9, 0)->cmd);
+
+    ASSERT_EQUAL(10, num_run);
+    for (uint32_t i=0; i<10; i++) ASSERT_EQUAL(expected[i], order[i]);
+
+    CmdQueueLaneStats stats;
+    cmdqueue_get_lane_stats(queue, CMDQUEUE_PRIO_LOW, &stats);
+    ASSERT_EQUAL(4, stats.dispatched);
+    ASSERT_EQUAL(2, stats.aged);
+    ASSERT_TRUE(stats.wait_max_ns >= stats.wait_total_ns / stats.dispatched);
+    cmdqueue_get_lane_stats(queue, CMDQUEUE_PRIO_HIGH, &stats);
+    ASSERT_EQUAL(6, stats.dispatched);
+    ASSERT_EQUAL(0, stats.aged);
+    cmdqueue_destroy(queue);
+}
+
+// a middle lane takes its turn too, and is not overtaken by the lowest one
+CTEST(cmdqueue, aging_levels) {
+    static const uint32_t expected[] = { 0, 4, 5, 1, 6, 7, 2, 8, 9, 3, 10 };
+
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags |= CMDQUEUE_ATTR_STATS;
+    attr.aging_ratio = 2;
+
+    CmdQueue* queue = cmdqueue_create_attr("test", test_callback, NULL, 16, sizeof(TestCmd), &attr);
+    num_run = 0;
+    num_started = 0;
+
+    cmdqueue_async_cmd(queue, &test_getcmd(queue, 0, 20000)->cmd);
+    while (!num_started) usleep(100);
+    cmdqueue_async_prio_cmd(queue, &test_getcmd(queue, 1, 0)->cmd, 100);
+    cmdqueue_async_cmd(queue, &test_getcmd(queue, 2, 0)->cmd);
+    cmdqueue_async_cmd(queue, &test_getcmd(queue, 3, 0)->cmd);
+    for (uint32_t i=4; i<10; i++) {
+        cmdqueue_async_prio_cmd(queue, &test_getcmd(queue, i, 0)->cmd, CMDQUEUE_PRIO_HIGH);
+    }
+    cmdqueue_sync_cmd(queue, &test_getcmd(queue, 10, 0)->cmd);
+
+    ASSERT_EQUAL(11, num_run);
+    for (uint32_t i=0; i<11; i++) ASSERT_EQUAL(expected[i], order[i]);
+
+    CmdQueueLaneStats stats;
+    cmdqueue_get_lane_stats(queue, 100, &stats);
+    ASSERT_EQUAL(1, stats.dispatched);
+    ASSERT_EQUAL(1, stats.aged);
+    cmdqueue_get_lane_stats(queue, CMDQUEUE_PRIO_LOW, &stats);
+    ASSERT_EQUAL(4, stats.dispatched);
+    ASSERT_EQUAL(1, stats.aged);
+    cmdqueue_destroy(queue);
+}
+
+CTEST(cmdqueue, stats) {
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags |= CMDQUEUE_ATTR_STATS;
+
+    CmdQueue* queue = cmdqueue_create_attr("test", test_callback, NULL, 4, sizeof(TestCmd), &attr);
+    num_run = 0;
+    num_started = 0;
+
+    cmdqueue_async_cmd(queue, &test_getcmd(queue, 0, 20000)->cmd);
+    while (!num_started) usleep(100);
+    for (uint32_t i=1; i<4; i++) cmdqueue_async_cmd(queue, &test_getcmd(queue, i, 0)->cmd);
+
+    CmdQueueStats stats;
+    cmdqueue_get_stats(queue, &stats);
+    ASSERT_EQUAL(3, stats.depth[CMDQUEUE_PRIO_LOW]);
+    ASSERT_NULL(cmdqueue_getcmd_async(queue));
+
+    // blocks until the worker frees one
+    cmdqueue_sync_cmd(queue, &test_getcmd(queue, 4, 0)->cmd);
+
+    cmdqueue_get_stats(queue, &stats);
+    ASSERT_EQUAL(0, stats.depth[CMDQUEUE_PRIO_LOW]);
+    ASSERT_EQUAL(2, stats.pool_empty);
+    ASSERT_EQUAL(1, stats.pool_wait.count);
+    ASSERT_EQUAL(5, stats.wait.count);
+    ASSERT_EQUAL(5, stats.exec.count);
+    ASSERT_EQUAL(1, stats.sync.count);
+    ASSERT_TRUE(cmdqueue_hist_percentile(&stats.exec, 100) >= 20000000);
+    ASSERT_TRUE(cmdqueue_hist_percentile(&stats.exec, 50) < 20000000);
+    cmdqueue_destroy(queue);
+}
+
+static uint32_t count_str(const char* text, const char* needle) {
+    uint32_t count = 0;
+    for (const char* p = strstr(text, needle); p; p = strstr(p + 1, needle)) count++;
+    return count;
+}
+
+CTEST(cmdqueue, trace_dump) {
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags |= CMDQUEUE_ATTR_TRACE;
+    attr.trace_events = 64;
+
+    CmdQueue* queue = cmdqueue_create_attr("test", test_callback, NULL, 4, sizeof(TestCmd), &attr);
+    num_run = 0;
+    cmdqueue_sync_cmd(queue, &test_getcmd(queue, 1, 0)->cmd);
+
+    char* text = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&text, &size);
+    ASSERT_EQUAL(0, cmdqueue_trace_dump(queue, out));
+    fclose(out);
+    ASSERT_TRUE(strncmp(text, "{\"traceEvents\":[", 15) == 0);
+    ASSERT_EQUAL(1, count_str(text, "\"getcmd\""));
+    ASSERT_EQUAL(1, count_str(text, "\"schedule\""));
+    ASSERT_EQUAL(2, count_str(text, "\"callback\""));
+    ASSERT_EQUAL(1, count_str(text, "\"complete\""));
+    ASSERT_EQUAL(1, count_str(text, "\"wake\""));
+    free(text);
+
+    // older events drop out of the ring, the dump stays bounded
+    for (uint32_t i=0; i<40; i++) cmdqueue_sync_cmd(queue, &test_getcmd(queue, i, 0)->cmd);
+    out = open_memstream(&text, &size);
+    ASSERT_EQUAL(0, cmdqueue_trace_dump(queue, out));
+    fclose(out);
+    // the caller records getcmd, schedule and wake per command
+    uint32_t scheduled = count_str(text, "\"schedule\"");
+    ASSERT_TRUE(scheduled > 0 && scheduled <= 64 / 3 + 1);
+    free(text);
+    cmdqueue_destroy(queue);
+}
+
+// the pending command ends up with the highest id submitted for its key
+static void merge_callback(void* cookie, Cmd* pending, Cmd* cmd)
+{
+    TestCmd* dst = to_container(TestCmd, cmd, pending);
+    TestCmd* src = to_container(TestCmd, cmd, cmd);
+    if (src->id > dst->id) dst->id = src->id;
+}
+
+CTEST(cmdqueue, coalesce) {
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags |= CMDQUEUE_ATTR_STATS;
+    attr.cmd_merge_callback = merge_callback;
+
+    CmdQueue* queue = cmdqueue_create_attr("test", test_callback, NULL, 8, sizeof(TestCmd), &attr);
+    num_run = 0;
+    num_started = 0;
+
+    cmdqueue_async_cmd(queue, &test_getcmd(queue, 1, 20000)->cmd);
+    while (!num_started) usleep(100);
+    ASSERT_EQUAL(0, cmdqueue_async_coalesced_cmd(queue, &test_getcmd(queue, 10, 0)->cmd, 7));
+    ASSERT_EQUAL(0, cmdqueue_async_coalesced_cmd(queue, &test_getcmd(queue, 20, 0)->cmd, 8));
+    for (uint32_t i=11; i<30; i++) {
+        ASSERT_EQUAL(1, cmdqueue_async_coalesced_cmd(queue, &test_getcmd(queue, i, 0)->cmd, 7));
+    }
+    cmdqueue_sync_cmd(queue, &test_getcmd(queue, 2, 0)->cmd);
+
+    ASSERT_EQUAL(4, num_run);
+    ASSERT_EQUAL(1, order[0]);
+    ASSERT_EQUAL(29, order[1]);
+    ASSERT_EQUAL(20, order[2]);
+    ASSERT_EQUAL(2, order[3]);
+
+    // ran, so the key queues again
+    ASSERT_EQUAL(0, cmdqueue_async_coalesced_cmd(queue, &test_getcmd(queue, 3, 0)->cmd, 7));
+    cmdqueue_sync_cmd(queue, &test_getcmd(queue, 4, 0)->cmd);
+    ASSERT_EQUAL(6, num_run);
+
+    CmdQueueStats stats;
+    cmdqueue_get_stats(queue, &stats);
+    ASSERT_EQUAL(19, stats.coalesced);
+    cmdqueue_destroy(queue);
+}
+
+CTEST(cmdqueue, grow_shrink) {
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags |= CMDQUEUE_ATTR_STATS;
+    attr.grow_commands = 4;
+    attr.max_commands = 16;
+    attr.size_classes[0] = 256;
+
+    CmdQueue* queue = cmdqueue_create_attr("test", test_callback, NULL, 4, sizeof(TestCmd), &attr);
+    CmdQueueStats stats;
+    cmdqueue_get_stats(queue, &stats);
+    ASSERT_EQUAL(4 * sizeof(TestCmd), stats.pool_bytes);
+
+    Cmd* cmds[16];
+    for (uint32_t i=0; i<16; i++) {
+        cmds[i] = cmdqueue_getcmd_async(queue);
+        ASSERT_NOT_NULL(cmds[i]);
+    }
+    ASSERT_NULL(cmdqueue_getcmd_async(queue));
+    cmdqueue_get_stats(queue, &stats);
+    ASSERT_EQUAL(16 * sizeof(TestCmd), stats.pool_bytes);
+
+    // the chunk with a command in use is the one that stays
+    for (uint32_t i=0; i<15; i++) cmdqueue_putcmd(queue, cmds[i]);
+    ASSERT_EQUAL(3, cmdqueue_shrink(queue));
+    cmdqueue_putcmd(queue, cmds[15]);
+    ASSERT_EQUAL(0, cmdqueue_shrink(queue));
+    cmdqueue_get_stats(queue, &stats);
+    ASSERT_EQUAL(4 * sizeof(TestCmd), stats.pool_bytes);
+
+    // the large class starts empty
+    ASSERT_NULL(cmdqueue_getcmd_sized(queue, 257));
+    num_run = 0;
+    TestCmd* big = (TestCmd*)cmdqueue_getcmd_sized(queue, 200);
+    ASSERT_NOT_NULL(big);
+    big->id = 1;
+    big->sleep_us = 0;
+    cmdqueue_sync_cmd(queue, &big->cmd);
+    ASSERT_EQUAL(1, num_run);
+    cmdqueue_get_stats(queue, &stats);
+    ASSERT_EQUAL(4 * sizeof(TestCmd) + 4 * 256, stats.pool_bytes);
+    ASSERT_EQUAL(1, cmdqueue_shrink(queue));
+    cmdqueue_destroy(queue);
+}
+
+CTEST(cmdqueue, aligned_hugepages) {
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags |= CMDQUEUE_ATTR_ALIGN | CMDQUEUE_ATTR_HUGEPAGES | CMDQUEUE_ATTR_PREFAULT;
+    attr.grow_commands = 8;
+    attr.max_commands = 32;
+
+    CmdQueue* queue = cmdqueue_create_attr("test", test_callback, NULL, 8, sizeof(TestCmd), &attr);
+    num_run = 0;
+    Cmd* cmds[20];
+    for (uint32_t i=0; i<20; i++) {
+        cmds[i] = cmdqueue_getcmd_sync(queue);
+        ASSERT_EQUAL(0, (uintptr_t)cmds[i] % 64);
+    }
+    for (uint32_t i=0; i<20; i++) cmdqueue_putcmd(queue, cmds[i]);
+    ASSERT_EQUAL(2, cmdqueue_shrink(queue));
+    cmdqueue_sync_cmd(queue, &test_getcmd(queue, 1, 0)->cmd);
+    ASSERT_EQUAL(1, num_run);
+    cmdqueue_destroy(queue);
+}
+
+static char thread_name[16];
+static int thread_cpu;
+static int thread_policy;
+static int thread_blocks_usr1;
+static int thread_blocks_segv;
+
+static void thread_attr_callback(void* cookie, Cmd* cmd)
+{
+    struct sched_param param;
+    sigset_t mask;
+    pthread_getname_np(pthread_self(), thread_name, sizeof(thread_name));
+    thread_cpu = sched_getcpu();
+    pthread_getschedparam(pthread_self(), &thread_policy, &param);
+    pthread_sigmask(SIG_SETMASK, NULL, &mask);
+    thread_blocks_usr1 = sigismember(&mask, SIGUSR1);
+    thread_blocks_segv = sigismember(&mask, SIGSEGV);
+}
+
+CTEST(cmdqueue, thread_attr) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(0, &cpus);
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.cpuset = &cpus;
+    attr.cpuset_size = sizeof(cpus);
+    attr.sched_policy = SCHED_BATCH;
+    attr.stack_size = 256 * 1024;
+
+    CmdQueue* queue = cmdqueue_create_attr("thread_attr_test", thread_attr_callback, NULL, 2, sizeof(Cmd), &attr);
+    cmdqueue_sync_cmd(queue, cmdqueue_getcmd_sync(queue));
+    ASSERT_STR("thread_attr_tes", thread_name);
+    ASSERT_EQUAL(0, thread_cpu);
+    ASSERT_EQUAL(SCHED_BATCH, thread_policy);
+    ASSERT_EQUAL(1, thread_blocks_usr1);
+    ASSERT_EQUAL(0, thread_blocks_segv);
+    ASSERT_EQUAL(0, cmdqueue_sched_error(queue));
+    cmdqueue_destroy(queue);
+
+    // an invalid priority for the policy is reported, the worker keeps the inherited policy
+    cmdqueue_attr_init(&attr);
+    attr.sched_policy = SCHED_OTHER;
+    attr.sched_priority = 99;
+    queue = cmdqueue_create_attr("test", thread_attr_callback, NULL, 2, sizeof(Cmd), &attr);
+    cmdqueue_sync_cmd(queue, cmdqueue_getcmd_sync(queue));
+    ASSERT_EQUAL(EINVAL, cmdqueue_sched_error(queue));
+    cmdqueue_destroy(queue);
+
+    // an explicit mask replaces the default of blocking everything
+    sigset_t mask;
+    sigemptyset(&mask);
+    cmdqueue_attr_init(&attr);
+    attr.num_workers = 2;
+    attr.sigmask = &mask;
+    queue = cmdqueue_create_attr("pool", thread_attr_callback, NULL, 2, sizeof(Cmd), &attr);
+    cmdqueue_sync_cmd(queue, cmdqueue_getcmd_sync(queue));
+    ASSERT_EQUAL('/', thread_name[4]);
+    ASSERT_EQUAL(0, thread_blocks_usr1);
+    cmdqueue_destroy(queue);
+}
+
+static void* magazine_thread(void* arg)
+{
+    CmdQueue* queue = (CmdQueue*)arg;
+    cmdqueue_putcmd(queue, cmdqueue_getcmd_sync(queue));
+    return 0;
+}
+
+CTEST(cmdqueue, magazine) {
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.magazine_size = 8;
+    CmdQueue* queue = cmdqueue_create_attr("test", test_callback, NULL, 32, sizeof(TestCmd), &attr);
+    Cmd* cmds[32];
+
+    // the first getcmd takes half a magazine
+    Cmd* cmd = cmdqueue_getcmd_sync(queue);
+    ASSERT_EQUAL(28, cmdqueue_getcmd_batch(queue, cmds, 32));
+    for (uint32_t i=0; i<28; i++) cmdqueue_putcmd(queue, cmds[i]);
+    cmdqueue_putcmd(queue, cmd);
+    cmdqueue_magazine_flush(queue);
+    ASSERT_EQUAL(32, cmdqueue_getcmd_batch(queue, cmds, 32));
+    for (uint32_t i=0; i<32; i++) cmdqueue_putcmd(queue, cmds[i]);
+    cmdqueue_magazine_flush(queue);
+
+    // an exiting thread hands its magazine back
+    pthread_t tid;
+    pthread_create(&tid, 0, magazine_thread, queue);
+    pthread_join(tid, 0);
+    ASSERT_EQUAL(32, cmdqueue_getcmd_batch(queue, cmds, 32));
+    for (uint32_t i=0; i<32; i++) cmdqueue_putcmd(queue, cmds[i]);
+
+    num_run = 0;
+    for (uint32_t i=0; i<40; i++) cmdqueue_sync_cmd(queue, &test_getcmd(queue, i, 0)->cmd);
+    ASSERT_EQUAL(40, num_run);
+    cmdqueue_destroy(queue);
+}
+
+typedef struct {
+    Cmd cmd;
+    uint32_t id;
+    uint32_t result;
+} ShmCmd;
+
+static uint32_t shm_run;
+static uint32_t shm_order_ok;
+
+static void shm_callback(void* cookie, Cmd* c)
+{
+    ShmCmd* cmd = to_container(ShmCmd, cmd, c);
+    // async ids count up from 1 in submission order
+    if (cmd->id && cmd->id < 1000) shm_order_ok &= (cmd->id == shm_run + 1);
+    if (cmd->id && cmd->id < 1000) shm_run++;
+    cmd->result = cmd->id * 2;
+}
+
+// attaches from another process, exit status 0 when all round trips came back right
+static int shm_child(const char* path)
+{
+    CmdQueue* queue = NULL;
+    for (uint32_t i=0; i<5000 && !queue; i++) {
+        queue = cmdqueue_attach_shm(path);
+        if (!queue) usleep(1000);
+    }
+    if (!queue) return 1;
+
+    for (uint32_t i=1; i<=200; i++) {
+        ShmCmd* cmd = (ShmCmd*)cmdqueue_getcmd_sync(queue);
+        cmd->id = i;
+        cmdqueue_async_cmd(queue, &cmd->cmd);
+    }
+    ShmCmd* cmd = (ShmCmd*)cmdqueue_getcmd_sync(queue);
+    cmd->id = 5000;
+    if (cmdqueue_sync_highprio_cmd(queue, &cmd->cmd) || cmd->result != 10000) return 2;
+    cmd = (ShmCmd*)cmdqueue_getcmd_sync(queue);
+    cmd->id = 0;
+    cmdqueue_sync_cmd(queue, &cmd->cmd);
+    cmdqueue_destroy(queue);
+    return 0;
+}
+
+CTEST(cmdqueue, shm) {
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/shm/cmdqueue_test_%d", (int)getpid());
+    shm_run = 0;
+    shm_order_ok = 1;
+
+    pid_t pid = fork();
+    if (!pid) _exit(shm_child(path));
+
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    CmdQueue* queue = cmdqueue_create_shm(path, shm_callback, NULL, 16, sizeof(ShmCmd), &attr);
+    ASSERT_NOT_NULL(queue);
+    int status = -1;
+    waitpid(pid, &status, 0);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQUAL(0, WEXITSTATUS(status));
+    ASSERT_EQUAL(200, shm_run);
+    ASSERT_EQUAL(1, shm_order_ok);
+
+    // a live queue's file is never reused
+    ASSERT_NULL(cmdqueue_create_shm(path, shm_callback, NULL, 16, sizeof(ShmCmd), &attr));
+    ASSERT_EQUAL(EEXIST, errno);
+
+    // the word after the magic is the layout version
+    int fd = open(path, O_RDWR);
+    ASSERT_TRUE(fd != -1);
+    uint32_t version = 0;
+    uint32_t bad = 1000;
+    ASSERT_EQUAL(4, pread(fd, &version, 4, 4));
+    ASSERT_EQUAL(4, pwrite(fd, &bad, 4, 4));
+    ASSERT_NULL(cmdqueue_attach_shm(path));
+    ASSERT_EQUAL(EINVAL, errno);
+    ASSERT_EQUAL(4, pwrite(fd, &version, 4, 4));
+    close(fd);
+    CmdQueue* attached = cmdqueue_attach_shm(path);
+    ASSERT_NOT_NULL(attached);
+    cmdqueue_destroy(attached);
+
+    // the pool is whole again, the lanes empty
+    ShmCmd* cmd = (ShmCmd*)cmdqueue_getcmd_sync(queue);
+    cmd->id = 7;
+    shm_run = 6;
+    cmdqueue_sync_cmd(queue, &cmd->cmd);
+    ASSERT_EQUAL(14, cmd->result);
+    cmdqueue_putcmd(queue, &cmd->cmd);
+    cmdqueue_destroy(queue);
+    ASSERT_EQUAL(-1, access(path, F_OK));
+}
+
+// producers on an attached handle timestamp their commands for the creator's stats too
+CTEST(cmdqueue, shm_stats) {
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/shm/cmdqueue_stats_%d", (int)getpid());
+
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags |= CMDQUEUE_ATTR_STATS;
+    CmdQueue* queue = cmdqueue_create_shm(path, shm_callback, NULL, 4, sizeof(ShmCmd), &attr);
+    ASSERT_NOT_NULL(queue);
+    CmdQueue* attached = cmdqueue_attach_shm(path);
+    ASSERT_NOT_NULL(attached);
+
+    for (uint32_t i=0; i<10; i++) {
+        ShmCmd* cmd = (ShmCmd*)cmdqueue_getcmd_sync(attached);
+        cmd->id = 0;
+        cmdqueue_sync_cmd(attached, &cmd->cmd);
+    }
+
+    CmdQueueStats stats;
+    cmdqueue_get_stats(queue, &stats);
+    ASSERT_EQUAL(10, stats.wait.count);
+    ASSERT_TRUE(cmdqueue_hist_percentile(&stats.wait, 100.0) < 1000000000ull);
+    CmdQueueLaneStats lane;
+    cmdqueue_get_lane_stats(queue, CMDQUEUE_PRIO_LOW, &lane);
+    ASSERT_EQUAL(10, lane.dispatched);
+    ASSERT_TRUE(lane.wait_max_ns < 1000000000ull);
+
+    cmdqueue_destroy(attached);
+    cmdqueue_destroy(queue);
+}
+
+static int32_t even_id(void* cookie, const Cmd* c)
+{
+    return to_container(TestCmd, cmd, c)->id % 2 == 0;
+}
+
+static void count_cancelled(void* cookie, Cmd* c)
+{
+    (*(uint32_t*)cookie)++;
+}
+
+static int32_t cancel_status;
+
+static void* cancel_waiter(void* arg)
+{
+    CmdQueue* queue = (CmdQueue*)arg;
+    cancel_status = cmdqueue_sync_cmd(queue, &test_getcmd(queue, 8, 0)->cmd);
+    return 0;
+}
+
+CTEST(cmdqueue, cancel_if) {
+    CmdQueueAttr attr;
+    cmdqueue_attr_init(&attr);
+    attr.flags |= CMDQUEUE_ATTR_STATS;
+
+    CmdQueue* queue = cmdqueue_create_attr("test", test_callback, NULL, 8, sizeof(TestCmd), &attr);
+    num_run = 0;
+    num_started = 0;
+
+    cmdqueue_async_cmd(queue, &test_getcmd(queue, 1, 20000)->cmd);
+    while (!num_started) usleep(100);
+    cmdqueue_async_cmd(queue, &test_getcmd(queue, 2, 0)->cmd);
+    cmdqueue_async_cmd(queue, &test_getcmd(queue, 3, 0)->cmd);
+    cmdqueue_async_prio_cmd(queue, &test_getcmd(queue, 4, 0)->cmd, 100);
+    cmdqueue_async_cmd_at(queue, &test_getcmd(queue, 6, 0)->cmd, now_ns() + 1000000000);
+    pthread_t tid;
+    pthread_create(&tid, 0, cancel_waiter, queue);
+
+    CmdQueueStats stats;
+    do {
+        usleep(100);
+        cmdqueue_get_stats(queue, &stats);
+    } while (stats.depth[CMDQUEUE_PRIO_LOW] < 3);
+
+    uint32_t callbacks = 0;
+    ASSERT_EQUAL(4, cmdqueue_cancel_if(queue, even_id, count_cancelled, &callbacks));
+    ASSERT_EQUAL(4, callbacks);
+    pthread_join(tid, 0);
+    ASSERT_EQUAL(ECANCELED, cancel_status);
+
+    cmdqueue_sync_cmd(queue, &test_getcmd(queue, 9, 0)->cmd);
+    ASSERT_EQUAL(3, num_run);
+    ASSERT_EQUAL(1, order[0]);
+    ASSERT_EQUAL(3, order[1]);
+    ASSERT_EQUAL(9, order[2]);
+
+    // every command is back in the pool
+    Cmd* cmds[8];
+    ASSERT_EQUAL(8, cmdqueue_getcmd_batch(queue, cmds, 8));
+    cmdqueue_async_cmd_batch(queue, cmds, 8);
+    cmdqueue_destroy(queue);
+}
+
+CTEST(cmdqueue, cancel_if_strands) {
+    CmdQueue* queue = cmdqueue_create_pool("test", test_callback, NULL, 8, sizeof(TestCmd), 2);
+    num_run = 0;
+    num_started = 0;
+
+    // 2..5 wait in the strand behind 1
+    cmdqueue_async_keyed_cmd(queue, &test_getcmd(queue, 1, 20000)->cmd, 7);
+    while (!num_started) usleep(100);
+    for (uint32_t i=2; i<6; i++) cmdqueue_async_keyed_cmd(queue, &test_getcmd(queue, i, 0)->cmd, 7);
+
+    ASSERT_EQUAL(2, cmdqueue_cancel_if(queue, even_id, NULL, NULL));
+    cmdqueue_sync_keyed_cmd(queue, &test_getcmd(queue, 9, 0)->cmd, 7);
+    ASSERT_EQUAL(4, num_run);
+    ASSERT_EQUAL(1, order[0]);
+    ASSERT_EQUAL(3, order[1]);
+    ASSERT_EQUAL(5, order[2]);
+    ASSERT_EQUAL(9, order[3]);
+
+    // no strand left
+    ASSERT_EQUAL(0, cmdqueue_cancel_if(queue, even_id, NULL, NULL));
+    cmdqueue_destroy(queue);
+}
+
+CTEST(cmdqueue, timer_order) {
+    CmdQueue* queue = cmdqueue_create("test", test_callback, NULL, 8, sizeof(TestCmd));
+    num_run = 0;
+
+    uint64_t start = now_ns();
+    cmdqueue_async_cmd_at(queue, &test_getcmd(queue, 1, 0)->cmd, start + 30000000);
+    cmdqueue_async_cmd_at(queue, &test_getcmd(queue, 2, 0)->cmd, start + 10000000);
+    cmdqueue_async_cmd_at(queue, &test_getcmd(queue, 3, 0)->cmd, start + 20000000);
+    while (num_run < 3) usleep(1000);
+    ASSERT_TRUE(now_ns() - start >= 30000000);
+
+    ASSERT_EQUAL(2, order[0]);
+    ASSERT_EQUAL(3, order[1]);
+    ASSERT_EQUAL(1, order[2]);
+    cmdqueue_destroy(queue);
+}
+
+CTEST(cmdqueue, timer_periodic_cancel) {
+    CmdQueue* queue = cmdqueue_create("test", test_callback, NULL, 1, sizeof(TestCmd));
+    num_run = 0;
+
+    TestCmd* cmd = test_getcmd(queue, 1, 0);
+    cmdqueue_async_cmd_periodic(queue, &cmd->cmd, now_ns() + 5000000, 5000000);
+    while (num_run < 3) usleep(1000);
+    ASSERT_EQUAL(1, cmdqueue_cancel_timer(queue, &cmd->cmd));
+    uint32_t cancelled_at = num_run;
+
+    // the slot comes back to the pool once it is not running anymore
+    ASSERT_TRUE(cmdqueue_getcmd_sync(queue) == &cmd->cmd);
+    usleep(20000);
+    ASSERT_TRUE(num_run <= cancelled_at + 1);
+
+    cmd->id = 2;
+    cmdqueue_async_cmd_at(queue, &cmd->cmd, now_ns() + 1000000000);
+    ASSERT_EQUAL(1, cmdqueue_cancel_timer(queue, &cmd->cmd));
+    ASSERT_NOT_NULL(cmdqueue_getcmd_async(queue));
+    cmdqueue_destroy(queue);
+}
+
@@ -0,0 +1,69 @@
+#include <stdlib.h>
+
+#include "ctest.h"
+#include "timerwheel.h"
+
+typedef struct {
+    struct list_tag node;
+    uint64_t expires;
+    uint64_t fired;
+} TestTimer;
+
+static uint64_t test_expires(void* ctx, list_t node)
+{
+    return ((TestTimer*)node)->expires;
+}
+
+CTEST(timerwheel, exact_expiry) {
+    const uint32_t num = 10000;
+    TestTimer* timers = calloc(num, sizeof(TestTimer));
+    TimerWheel wheel;
+    timerwheel_init(&wheel, 1000, test_expires, NULL);
+
+    srand(42);
+    for (uint32_t i=0; i<num; i++) {
+        // spread over all levels
+        timers[i].expires = 1000 + ((uint64_t)rand() % (1u << (6 * (1 + i % 3))));
+        timerwheel_add(&wheel, &timers[i].node);
+    }
+    // some get cancelled again
+    for (uint32_t i=0; i<num; i+=7) {
+        timerwheel_remove(&wheel, &timers[i].node);
+        timers[i].fired = 1;
+    }
+
+    uint64_t now = 1000;
+    while (wheel.count) {
+        uint64_t next = timerwheel_next(&wheel);
+        ASSERT_TRUE(next >= now);
+        now = next;
+
+        struct list_tag expired;
+        list_init(&expired);
+        timerwheel_advance(&wheel, now, &expired);
+        while (!list_empty(&expired)) {
+            TestTimer* t = (TestTimer*)expired.next;
+            list_remove(&t->node);
+            ASSERT_EQUAL(t->expires, now);
+            t->fired = 1;
+        }
+        now++;
+    }
+    for (uint32_t i=0; i<num; i++) ASSERT_EQUAL(1, timers[i].fired);
+    free(timers);
+}
+
+CTEST(timerwheel, beyond_range) {
+    TestTimer timer = { .expires = 5 + (1ull << 26) };
+    TimerWheel wheel;
+    timerwheel_init(&wheel, 5, test_expires, NULL);
+    timerwheel_add(&wheel, &timer.node);
+
+    struct list_tag expired;
+    list_init(&expired);
+    timerwheel_advance(&wheel, timer.expires - 1, &expired);
+    ASSERT_TRUE(list_empty(&expired));
+    timerwheel_advance(&wheel, timer.expires, &expired);
+    ASSERT_TRUE(expired.next == &timer.node);
+}
+
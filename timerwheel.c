@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include "timerwheel.h"
+
+#define SLOT_MASK   (TIMERWHEEL_SLOTS - 1)
+
+void timerwheel_init(TimerWheel* w, uint64_t now, uint64_t (*expires)(void* ctx, list_t node), void* ctx) {
+    for (uint32_t l=0; l<TIMERWHEEL_LEVELS; l++) {
+        for (uint32_t s=0; s<TIMERWHEEL_SLOTS; s++) list_init(&w->slots[l][s]);
+    }
+    w->occupied = 0;
+    w->now = now;
+    w->count = 0;
+    w->expires = expires;
+    w->ctx = ctx;
+}
+
+static void timerwheel_place(TimerWheel* w, list_t node) {
+    uint64_t expires = w->expires(w->ctx, node);
+    if (expires < w->now) expires = w->now;
+    uint64_t delta = expires - w->now;
+
+    uint32_t level = 0;
+    while (level < TIMERWHEEL_LEVELS - 1 && delta >= (1ull << (TIMERWHEEL_BITS * (level + 1)))) level++;
+    // beyond the range the node parks in the last slot in reach and is re-placed on cascade
+    if (delta >= (1ull << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS))) {
+        expires = w->now + (1ull << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS)) - 1;
+    }
+
+    uint32_t slot = (expires >> (TIMERWHEEL_BITS * level)) & SLOT_MASK;
+    list_add_tail(&w->slots[level][slot], node);
+    if (level == 0) w->occupied |= 1ull << slot;
+}
+
+void timerwheel_add(TimerWheel* w, list_t node) {
+    timerwheel_place(w, node);
+    w->count++;
+}
+
+void timerwheel_remove(TimerWheel* w, list_t node) {
+    list_remove(node);
+    w->count--;
+}
+
+static uint32_t timerwheel_cascade(TimerWheel* w, uint32_t level) {
+    uint32_t slot = (w->now >> (TIMERWHEEL_BITS * level)) & SLOT_MASK;
+    struct list_tag tmp;
+    list_init(&tmp);
+    list_move(&w->slots[level][slot], &tmp);
+
+    list_t node = tmp.next;
+    while (node != &tmp) {
+        list_t next = node->next;
+        timerwheel_place(w, node);
+        node = next;
+    }
+    return slot;
+}
+
+void timerwheel_advance(TimerWheel* w, uint64_t now, list_t expired) {
+    if (!w->count) {
+        if (now >= w->now) w->now = now + 1;
+        return;
+    }
+
+    while (w->now <= now) {
+        uint32_t slot = w->now & SLOT_MASK;
+        if (slot == 0) {
+            for (uint32_t l=1; l<TIMERWHEEL_LEVELS; l++) {
+                if (timerwheel_cascade(w, l) != 0) break;
+            }
+        }
+
+        list_t head = &w->slots[0][slot];
+        while (!list_empty(head)) {
+            list_t node = head->next;
+            list_remove(node);
+            list_add_tail(expired, node);
+            w->count--;
+        }
+        w->occupied &= ~(1ull << slot);
+        w->now++;
+        if (!w->count) {
+            if (now >= w->now) w->now = now + 1;
+            return;
+        }
+        // empty level 0, nothing can fire before the next cascade
+        if (!w->occupied && (w->now & SLOT_MASK)) {
+            uint64_t wrap = (w->now | SLOT_MASK) + 1;
+            w->now = (wrap <= now) ? wrap : now + 1;
+        }
+    }
+}
+
+uint64_t timerwheel_next(TimerWheel* w) {
+    uint32_t pos = w->now & SLOT_MASK;
+    // level 0 only holds the next TIMERWHEEL_SLOTS ticks, rotate so bit 0 is the current tick
+    uint64_t ahead = pos ? (w->occupied >> pos) | (w->occupied << (TIMERWHEEL_SLOTS - pos)) : w->occupied;
+    while (ahead) {
+        uint32_t off = __builtin_ctzll(ahead);
+        uint32_t slot = (pos + off) & SLOT_MASK;
+        if (!list_empty(&w->slots[0][slot])) return w->now + off;
+        // lazily drop bits of slots emptied by timerwheel_remove
+        w->occupied &= ~(1ull << slot);
+        ahead &= ahead - 1;
+    }
+    // nothing on level 0, the next cascade may bring work
+    return pos ? (w->now | SLOT_MASK) + 1 : w->now;
+}
+
@@ -0,0 +1,45 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+#include "list.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TIMERWHEEL_LEVELS   4
+#define TIMERWHEEL_BITS     6
+#define TIMERWHEEL_SLOTS    (1 << TIMERWHEEL_BITS)
+
+// hierarchical timing wheel over intrusive list nodes, times are in ticks
+typedef struct {
+    struct list_tag slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+    uint64_t occupied;          // level 0 slots that may be non-empty
+    uint64_t now;               // next tick to expire
+    uint32_t count;
+    uint64_t (*expires)(void* ctx, list_t node);    // expiry tick of a node
+    void* ctx;
+} TimerWheel;
+
+void timerwheel_init(TimerWheel* w, uint64_t now, uint64_t (*expires)(void* ctx, list_t node), void* ctx);
+
+// O(1), nodes that are already due fire on the next advance
+void timerwheel_add(TimerWheel* w, list_t node);
+
+// O(1)
+void timerwheel_remove(TimerWheel* w, list_t node);
+
+// moves every node due at or before now to the tail of expired
+void timerwheel_advance(TimerWheel* w, uint64_t now, list_t expired);
+
+// earliest tick at which advance can yield something, only valid with count > 0
+uint64_t timerwheel_next(TimerWheel* w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "util.h"
+
+static uint64_t trace_gen;
+
+// last ring used by this thread, saves the list walk on every event
+static __thread struct {
+    Trace* trace;
+    uint64_t gen;
+    TraceRing* ring;
+} trace_cache;
+
+void trace_init(Trace* trace, uint32_t size) {
+    assert(size && !(size & (size - 1)));
+    trace->rings = NULL;
+    trace->size = size;
+    trace->gen = __atomic_add_fetch(&trace_gen, 1, __ATOMIC_RELAXED);
+}
+
+void trace_destroy(Trace* trace) {
+    TraceRing* ring = trace->rings;
+    while (ring) {
+        TraceRing* next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    trace->rings = NULL;
+}
+
+static TraceRing* trace_ring(Trace* trace) {
+    if (trace_cache.trace == trace && trace_cache.gen == trace->gen) return trace_cache.ring;
+
+    uint32_t tid = (uint32_t)syscall(SYS_gettid);
+    TraceRing* ring = __atomic_load_n(&trace->rings, __ATOMIC_ACQUIRE);
+    while (ring && ring->tid != tid) ring = ring->next;
+    if (!ring) {
+        ring = malloc(sizeof(TraceRing) + trace->size * sizeof(TraceEvent));
+        assert(ring);
+        ring->tid = tid;
+        ring->head = 0;
+        ring->next = __atomic_load_n(&trace->rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace->rings, &ring->next, ring, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    }
+    trace_cache.trace = trace;
+    trace_cache.gen = trace->gen;
+    trace_cache.ring = ring;
+    return ring;
+}
+
+void trace_event(Trace* trace, uint32_t type, uint32_t idx) {
+    TraceRing* ring = trace_ring(trace);
+    uint64_t head = ring->head;
+    TraceEvent* ev = &ring->events[head & (trace->size - 1)];
+    ev->ts_ns = now_ns();
+    ev->idx = idx;
+    ev->type = type;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static const char* trace_names[] = {
+    [TRACE_GETCMD]       = "getcmd",
+    [TRACE_POOL_BLOCK]   = "pool_wait",
+    [TRACE_POOL_UNBLOCK] = "pool_wait",
+    [TRACE_SCHEDULE]     = "schedule",
+    [TRACE_DEQUEUE]      = "dequeue",
+    [TRACE_CB_START]     = "callback",
+    [TRACE_CB_END]       = "callback",
+    [TRACE_COMPLETE]     = "complete",
+    [TRACE_WAKE]         = "wake",
+};
+
+static void trace_write(FILE* out, const TraceEvent* ev, int pid, uint32_t tid) {
+    uint64_t ts = ev->ts_ns;
+    const char* name = trace_names[ev->type];
+    const char* ph = "i";
+    if (ev->type == TRACE_POOL_BLOCK || ev->type == TRACE_CB_START) ph = "B";
+    if (ev->type == TRACE_POOL_UNBLOCK || ev->type == TRACE_CB_END) ph = "E";
+
+    fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%s\",%s\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%u",
+            name, ph, ph[0] == 'i' ? "\"s\":\"t\"," : "",
+            (unsigned long long)(ts / 1000), (unsigned long long)(ts % 1000), pid, tid);
+    if (ev->idx != 0xFFFFFFFF) fprintf(out, ",\"args\":{\"cmd\":%u}", ev->idx);
+    fprintf(out, "}");
+
+    // per command track, from schedule through the queue wait until the worker is done with it
+    const char* span = NULL;
+    if (ev->type == TRACE_SCHEDULE) {
+        span = "\"name\":\"cmd\",\"ph\":\"b\"";
+    } else if (ev->type == TRACE_COMPLETE) {
+        span = "\"name\":\"cmd\",\"ph\":\"e\"";
+    }
+    if (span) {
+        fprintf(out, ",\n{%s,\"cat\":\"cmd\",\"id\":%u,\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%u}",
+                span, ev->idx, (unsigned long long)(ts / 1000), (unsigned long long)(ts % 1000), pid, tid);
+    }
+    if (ev->type == TRACE_SCHEDULE || ev->type == TRACE_DEQUEUE) {
+        fprintf(out, ",\n{\"name\":\"queued\",\"ph\":\"%s\",\"cat\":\"cmd\",\"id\":%u,\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%u}",
+                ev->type == TRACE_SCHEDULE ? "b" : "e", ev->idx,
+                (unsigned long long)(ts / 1000), (unsigned long long)(ts % 1000), pid, tid);
+    }
+}
+
+int32_t trace_dump(Trace* trace, FILE* out, const char* name) {
+    int pid = getpid();
+    fprintf(out, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+            pid, name ? name : "cmdqueue");
+
+    TraceEvent* copy = malloc(trace->size * sizeof(TraceEvent));
+    assert(copy);
+    for (TraceRing* ring = __atomic_load_n(&trace->rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t base = head > trace->size ? head - trace->size : 0;
+        for (uint64_t i=base; i<head; i++) copy[i - base] = ring->events[i & (trace->size - 1)];
+
+        // slots the writer reached during the copy (including the one it may be filling) are torn
+        uint64_t start = base;
+        uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (now + 1 > start + trace->size) start = now + 1 - trace->size;
+        for (uint64_t i=start; i<head; i++) trace_write(out, &copy[i - base], pid, ring->tid);
+    }
+    free(copy);
+
+    fprintf(out, "\n]}\n");
+    return ferror(out) ? -1 : 0;
+}
+
@@ -0,0 +1,59 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    TRACE_GETCMD = 0,
+    TRACE_POOL_BLOCK,       // cmdqueue_getcmd_sync found the pool empty
+    TRACE_POOL_UNBLOCK,
+    TRACE_SCHEDULE,
+    TRACE_DEQUEUE,
+    TRACE_CB_START,
+    TRACE_CB_END,
+    TRACE_COMPLETE,         // worker is done with the command
+    TRACE_WAKE,             // sync waiter returns
+} TraceEventType;
+
+typedef struct {
+    uint64_t ts_ns;
+    uint32_t idx;           // command slot
+    uint32_t type;          // TraceEventType
+} TraceEvent;
+
+// single writer ring, the dumper only reads what was not overwritten meanwhile
+typedef struct TraceRing_ {
+    struct TraceRing_* next;
+    uint32_t tid;
+    uint64_t head;          // events written so far
+    TraceEvent events[];
+} TraceRing;
+
+typedef struct {
+    TraceRing* rings;       // one per thread that traced, prepend only
+    uint32_t size;          // events per ring, power of two
+    uint64_t gen;           // tells a new Trace apart from a freed one at the same address
+} Trace;
+
+void trace_init(Trace* trace, uint32_t size);
+
+// no thread may record anymore
+void trace_destroy(Trace* trace);
+
+// lock-free, the first event of a thread allocates its ring
+void trace_event(Trace* trace, uint32_t type, uint32_t idx);
+
+// Chrome trace / Perfetto JSON, returns 0 or -1 on a write error
+int32_t trace_dump(Trace* trace, FILE* out, const char* name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -3,6 +3,37 @@
 
 #define ARRAY_SIZE(a) ((sizeof(a) / sizeof(*(a))))
 
+#include <stdint.h>
+#include <time.h>
+
+#define CACHE_LINE 64
+
+// own cache line for data other threads write, -DCMDQUEUE_PACKED drops the padding for comparison
+#ifdef CMDQUEUE_PACKED
+#define CACHE_ALIGNED
+#else
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE)))
+#endif
+
 #define PTHREAD_CHK(expr) do { if (expr != 0) {assert(0);fprintf((FILE *)2, "System call error\n");};} while(0)
 
+// pause hint for spin loops, eases the pipeline and the sibling hyperthread
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
 #endif